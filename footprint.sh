@@ -0,0 +1,88 @@
+#!/bin/sh
+# Reports what mfs_server costs in flash and RAM, for every feature configuration, on the host and on a reference MCU target.
+# Usage: ./footprint.sh [clients] [files] [transfers] [path buffer size] [data buffer size]
+# The target toolchain defaults to arm-none-eabi (Cortex-M4), override with TARGET_PREFIX and TARGET_FLAGS. It is skipped if it isn't installed.
+
+CLIENTS=${1:-4}
+FILES=${2:-16}
+TRANSFERS=${3:-2}
+PATH_BSIZE=${4:-64}
+DATA_BSIZE=${5:-512}
+TRANSFER_SLOTS=$(( TRANSFERS > 0 ? TRANSFERS : 1 )) # The probe's transfer table, a zero length array isn't C++.
+
+HOST_PREFIX=${HOST_PREFIX:-}
+HOST_FLAGS=${HOST_FLAGS:--Os}
+TARGET_PREFIX=${TARGET_PREFIX:-arm-none-eabi-}
+TARGET_FLAGS=${TARGET_FLAGS:--Os -mcpu=cortex-m4 -mthumb}
+
+# One configuration per line: name, then the compiler flags that select it.
+CONFIGS="default|
+asserts|-DMFS_ASSERT(x)=if(!(x))__builtin_trap()
+no-capture|-DMFS_ENABLE_CAPTURE=0
+no-streaming|-DMFS_ENABLE_STREAMING=0
+no-ls|-DMFS_ENABLE_LS=0
+read-only|-DMFS_ENABLE_WRITE=0
+no-crc|-DMFS_ENABLE_CRC=0
+crc-bytewise|-DMFS_CRC_SLICES=1
+minimal|-DMFS_ENABLE_LS=0 -DMFS_ENABLE_WRITE=0 -DMFS_ENABLE_STREAMING=0 -DMFS_ENABLE_STAT=0 -DMFS_ENABLE_READ_IF=0 -DMFS_ENABLE_CRC=0 -DMFS_ENABLE_CAPTURE=0 -DMFS_ENABLE_READ_MANY=0 -DMFS_ENABLE_SUBSCRIBE=0 -DMFS_ENABLE_SPLIT=0 -DMFS_ENABLE_EVENTS=0 -DMFS_ENABLE_HANDOFF=0 -DMFS_ENABLE_SESSIONS=0 -DMFS_ENABLE_COALESCE=0 -DMFS_ENABLE_DRAIN=0"
+
+set -f # The configuration flags are split on spaces, but never globbed.
+SRC_DIR=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# The library is header style (everything inline), so the probe has to actually use the entry points for code to get emitted.
+# It allocates a server statically the way firmware would, so bss is what that really costs, next to mfs_static_ram()'s figure for it. The CRC tables are const, they count as text.
+# bss runs a little higher, the linker pads between the objects.
+# The transport callbacks are only declared, the probe is compiled but never linked.
+cat > "$WORK/probe.cpp" <<PROBE
+#include "$SRC_DIR/main.cpp"
+char mfs_ram_probe[mfs_static_ram($CLIENTS, $FILES, $TRANSFERS, $PATH_BSIZE, $DATA_BSIZE)];
+long long probe_read(client_t client, char* buffer, unsigned long long size);
+long long probe_write(client_t client, char* buffer, unsigned long long size);
+client_t probe_accept();
+void probe_close(client_t client);
+unsigned long long probe_time();
+unsigned long long probe_available(client_t client);
+static char probe_path[$PATH_BSIZE];
+static char probe_data[$DATA_BSIZE];
+static client_handlers_t probe_clients[$CLIENTS];
+static mfs_file_t probe_files[$FILES];
+static mfs_transfer_t probe_transfers[$TRANSFER_SLOTS];
+static mfs_server probe_server(probe_read, probe_write, probe_accept, probe_close, probe_time, probe_available, probe_data, $DATA_BSIZE, probe_path, $PATH_BSIZE,
+                               probe_clients, $CLIENTS, probe_files, $FILES, probe_transfers, $TRANSFERS);
+void mfs_footprint_probe(mfs_file_t* file) {
+    probe_server.accept_clients();
+    probe_server.serve_clients();
+    probe_server.register_file(file);
+    probe_server.unregister_file(file->path, file->path_size);
+    probe_server.update_file(file->path, file->path_size, 0);
+}
+PROBE
+
+report() {
+    prefix=$1
+    flags=$2
+    if ! command -v "${prefix}g++" > /dev/null 2>&1; then
+        echo "${prefix}g++ not found, skipping."
+        return
+    fi
+    printf "%-12s %8s %8s %8s %10s\n" config text data bss static_ram
+    echo "$CONFIGS" | while IFS='|' read -r name defines; do
+        if ! "${prefix}g++" -std=c++11 -fno-exceptions -fno-rtti $flags $defines -c "$WORK/probe.cpp" -o "$WORK/probe.o" 2> "$WORK/err.txt"; then
+            echo "$name: failed to compile"
+            cat "$WORK/err.txt"
+            continue
+        fi
+        ram=$(( 0x$("${prefix}nm" -S "$WORK/probe.o" | awk '$4 == "mfs_ram_probe" { print $2 }') ))
+        "${prefix}size" "$WORK/probe.o" | awk -v name="$name" -v ram="$ram" 'NR == 2 { printf "%-12s %8d %8d %8d %10d\n", name, $1, $2, $3 - ram, ram }'
+    done
+}
+
+echo "clients=$CLIENTS files=$FILES transfers=$TRANSFERS path buffer=$PATH_BSIZE data buffer=$DATA_BSIZE"
+echo
+echo "Host (${HOST_PREFIX}g++ $HOST_FLAGS):"
+report "$HOST_PREFIX" "$HOST_FLAGS"
+echo
+echo "Target (${TARGET_PREFIX}g++ $TARGET_FLAGS):"
+report "$TARGET_PREFIX" "$TARGET_FLAGS"
@@ -0,0 +1,60 @@
+#!/bin/sh
+# Builds and runs fuzz_mfs.cpp, the fuzzing harness for mfs_server, and split_mfs.cpp, the split mode test.
+# Usage: ./fuzz.sh fuzz [seconds] [corpus dir]     libFuzzer run (clang), the corpus grows in the corpus directory
+#        ./fuzz.sh run files...                    replays inputs (crash reproduction) with ASan and UBSan, no clang needed
+#        ./fuzz.sh bench [corpus dir] [seconds]    throughput over a corpus, optimised build without sanitizers
+#        ./fuzz.sh split [requests per client]     split mode with the I/O and handler loops on two threads, with TSan (Linux only)
+# The corpus defaults to fuzz_corpus/ next to this script. Extra compiler flags go in FUZZ_FLAGS, a feature configuration for example (-DMFS_ENABLE_CRC=0).
+
+SRC_DIR=$(cd "$(dirname "$0")" && pwd)
+CLANG=${CLANG:-clang++}
+CXX=${CXX:-g++}
+FUZZ_FLAGS=${FUZZ_FLAGS:-}
+MODE=${1:-fuzz}
+[ $# -gt 0 ] && shift
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+case "$MODE" in
+fuzz)
+    SECONDS_TO_RUN=${1:-60}
+    CORPUS=${2:-$SRC_DIR/fuzz_corpus}
+    if ! command -v "$CLANG" > /dev/null 2>&1; then
+        echo "$CLANG not found, libFuzzer needs clang. (./fuzz.sh run works with $CXX.)"
+        exit 1
+    fi
+    mkdir -p "$CORPUS"
+    "$CLANG" -std=c++11 -g -O1 -fsanitize=fuzzer,address,undefined -DMFS_FUZZ_NO_MAIN $FUZZ_FLAGS "$SRC_DIR/fuzz_mfs.cpp" -o "$WORK/fuzz_mfs" || exit 1
+    # Crashes land in the current directory as crash-*, replay them with ./fuzz.sh run.
+    "$WORK/fuzz_mfs" -max_total_time="$SECONDS_TO_RUN" -max_len=4096 "$CORPUS"
+    ;;
+run)
+    "$CXX" -std=c++11 -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=undefined $FUZZ_FLAGS "$SRC_DIR/fuzz_mfs.cpp" -o "$WORK/fuzz_mfs" || exit 1
+    for input in "$@"; do
+        if ! "$WORK/fuzz_mfs" "$input"; then
+            echo "FAILED: $input"
+            exit 1
+        fi
+    done
+    echo "$# inputs passed."
+    ;;
+bench)
+    CORPUS=${1:-$SRC_DIR/fuzz_corpus}
+    SECONDS_TO_RUN=${2:-10}
+    if [ -z "$(ls -A "$CORPUS" 2> /dev/null)" ]; then
+        echo "$CORPUS is empty, fuzz for a while first to build a corpus."
+        exit 1
+    fi
+    "$CXX" -std=c++11 -O2 $FUZZ_FLAGS "$SRC_DIR/fuzz_mfs.cpp" -o "$WORK/fuzz_mfs" || exit 1
+    "$WORK/fuzz_mfs" -bench "$SECONDS_TO_RUN" "$CORPUS"/*
+    ;;
+split)
+    "$CXX" -std=c++11 -g -O1 -fsanitize=thread $FUZZ_FLAGS "$SRC_DIR/split_mfs.cpp" -o "$WORK/split_mfs" -lpthread || exit 1
+    "$WORK/split_mfs" "$@"
+    ;;
+*)
+    echo "Unknown mode $MODE, see the top of $0."
+    exit 1
+    ;;
+esac
@@ -0,0 +1,479 @@
+// Fuzzing harness for mfs_server, built by fuzz.sh. Works with libFuzzer (LLVMFuzzerTestOneInput) and AFL (the standalone main() below reads the input file.)
+// The input is a script for a few clients talking to the server over an in-memory transport. After every pass the harness checks that:
+//   - what the server wrote is whole, well formed frames (with a valid CRC trailer once a client negotiated one), so the output stream stays in sync,
+//   - every well formed request from a client that never sent garbage is consumed completely, so the input stream stays in sync,
+//   - the guard bytes around the server's buffers and tables are untouched. MFS_ASSERT traps inside the server too.
+// The input is a sequence of [command (1 byte)][arguments] records. The low 2 bits of the command pick the client, bits 2 to 4 what happens:
+//   0-3 a request [op][path selector][data size][data] (a client that isn't connected connects instead), 4 garbage [size][bytes],
+//   5 the clock moves [ms / 64], 6 the application changes a file or re-registers one [action], 7 the client hangs up.
+// Built without libFuzzer, `fuzz_mfs -bench seconds files...` runs a corpus over and over and reports the throughput, parser changes can be checked for speed and safety with the same inputs.
+#define MFS_ASSERT(x) if (!(x)) __builtin_trap()
+#include "main.cpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FUZZ_CHECK(x) if (!(x)) __builtin_trap()
+
+#define FUZZ_CLIENTS 3
+#define FUZZ_PATH_BSIZE 32
+#define FUZZ_DATA_BSIZE 64
+#define FUZZ_FILES 8
+#define FUZZ_GUARD 16
+#define FUZZ_PIPE 4096
+
+// One end of a client connection. in is what the client sent and the server hasn't read yet, out is what the server wrote and the harness hasn't checked yet.
+typedef struct {
+    char in[FUZZ_PIPE];
+    unsigned int in_len;
+    char out[FUZZ_PIPE * 4];
+    unsigned int out_len;
+    unsigned char open; // Accepted by the server and not closed since.
+    unsigned char hung_up; // The client went away, reads and writes fail.
+    unsigned char tainted; // Sent bytes that aren't a well formed frame, the input can't be expected to stay in sync anymore.
+    unsigned char crc; // Frames from the server carry a CRC trailer.
+} fuzz_pipe_t;
+
+static fuzz_pipe_t pipes[FUZZ_CLIENTS + 1];
+static client_t pending_accept = 0;
+static unsigned long long fuzz_now = 0;
+
+// The server's buffers, each with guard bytes on both sides.
+static struct {
+    char pre_path[FUZZ_GUARD];
+    char path[FUZZ_PATH_BSIZE];
+    char pre_data[FUZZ_GUARD];
+    char data[FUZZ_DATA_BSIZE];
+    char pre_clients[FUZZ_GUARD];
+    client_handlers_t clients[FUZZ_CLIENTS];
+    char pre_files[FUZZ_GUARD];
+    mfs_file_t files[FUZZ_FILES];
+    char pre_transfers[FUZZ_GUARD];
+    mfs_transfer_t transfers[2];
+    char pre_sessions[FUZZ_GUARD];
+    mfs_session_t sessions[4];
+    char pre_journal[FUZZ_GUARD];
+    char journal[64];
+    char pre_delta[FUZZ_GUARD];
+    char delta[FUZZ_CLIENTS * 48];
+    char pre_coalesce[FUZZ_GUARD];
+    char coalesce[256];
+    char post[FUZZ_GUARD];
+} arena;
+
+static void check_guard(char* guard) {
+    for (unsigned int i = 0; i < FUZZ_GUARD; i++) FUZZ_CHECK((unsigned char)guard[i] == 0xA5);
+}
+
+static void check_guards() {
+    check_guard(arena.pre_path);
+    check_guard(arena.pre_data);
+    check_guard(arena.pre_clients);
+    check_guard(arena.pre_files);
+    check_guard(arena.pre_transfers);
+    check_guard(arena.pre_sessions);
+    check_guard(arena.pre_journal);
+    check_guard(arena.pre_delta);
+    check_guard(arena.pre_coalesce);
+    check_guard(arena.post);
+}
+
+// Transport callbacks.
+static long long fuzz_read(client_t client, char* buffer, unsigned long long size) {
+    fuzz_pipe_t* p = &pipes[client];
+    if (p->hung_up) return -1;
+    unsigned int n = size < p->in_len ? size : p->in_len;
+    memcpy(buffer, p->in, n);
+    memmove(p->in, p->in + n, p->in_len - n);
+    p->in_len -= n;
+    return n;
+}
+
+static long long fuzz_write(client_t client, char* buffer, unsigned long long size) {
+    fuzz_pipe_t* p = &pipes[client];
+    if (p->hung_up) return -1;
+    if (size > sizeof p->out - p->out_len) return -1; // The client stopped reading, as far as the server can tell.
+    if (size == 0) return 0; // Empty paths and payloads may come with a NULL buffer.
+    memcpy(p->out + p->out_len, buffer, size);
+    p->out_len += size;
+    return size;
+}
+
+static void fuzz_close(client_t client) {
+    pipes[client].open = 0;
+}
+
+static unsigned long long fuzz_available(client_t client) {
+    if (client == 0) return 0;
+    if (pipes[client].hung_up) return 9; // A socket at EOF is readable, the read fails.
+    return pipes[client].in_len;
+}
+
+static client_t fuzz_accept() {
+    client_t client = pending_accept;
+    pending_accept = 0;
+    if (client != 0) pipes[client].open = 1;
+    return client;
+}
+
+static unsigned long long fuzz_time() {
+    return fuzz_now;
+}
+
+// File handlers. The contents are small enough for every response to fit the data buffer.
+static char value[FUZZ_DATA_BSIZE];
+static unsigned int value_len = 5;
+static char stored[FUZZ_DATA_BSIZE];
+static char blob[300];
+
+static mfs_message_t read_value(mfs_message_t request) {
+    request.op = RESPONSE_OF(OP_READ);
+    request.data = value;
+    request.dsize = value_len;
+    return request;
+}
+
+static mfs_message_t write_value(mfs_message_t request) {
+    value_len = request.dsize < sizeof value ? request.dsize : sizeof value;
+    memcpy(value, request.data, value_len);
+    request.op = RESPONSE_OF(OP_WRITE);
+    request.dsize = 0;
+    return request;
+}
+
+static mfs_message_t read_failing(mfs_message_t request) {
+    request.op = RESPONSE_OF(OP_ERROR);
+    request.dsize = 0;
+    return request;
+}
+
+static long long read_blob(unsigned long long offset, char* buffer, unsigned int size) {
+    if (offset >= sizeof blob) return 0;
+    if (size > sizeof blob - offset) size = sizeof blob - offset;
+    memcpy(buffer, blob + offset, size);
+    return size;
+}
+
+static long long write_blob(unsigned long long offset, char* buffer, unsigned int size) {
+    if (offset > sizeof blob) return -1;
+    if (size > sizeof blob - offset) size = sizeof blob - offset;
+    memcpy(blob + offset, buffer, size);
+    return size;
+}
+
+static char doubled[FUZZ_DATA_BSIZE];
+
+// "/double" is derived from "/value", the value twice over (cut to the data buffer.)
+static mfs_message_t compute_doubled(void* /*context*/, unsigned int /*file_index*/, client_t /*client*/, mfs_message_t request) {
+    unsigned int n = value_len * 2 < sizeof doubled ? value_len * 2 : sizeof doubled;
+    for (unsigned int i = 0; i < n; i++) doubled[i] = value[i % value_len];
+    request.op = RESPONSE_OF(OP_READ);
+    request.data = doubled;
+    request.dsize = value_len == 0 ? 0 : n;
+    return request;
+}
+
+// Paths the requests pick from. The path buffers are larger than the strings on purpose, nothing past the terminator may reach the wire.
+static const char* known_paths[] = {"/value", "/blob", "/fail", "/double", "/toggle", "/ghost"};
+#define FUZZ_KNOWN_PATHS 6
+static char path_store[FUZZ_KNOWN_PATHS][24];
+static char derived_deps[] = "/value";
+static char derived_cache[FUZZ_DATA_BSIZE];
+static mfs_derived_t derived;
+static int toggle_is_blob = 0;
+
+static void register_toggle(mfs_server* server) {
+    // Swaps what lives in the slot freed by unregistering "/toggle", so anything still pointing at the slot by index sees another file.
+    mfs_file_t file = {};
+    file.path = path_store[4];
+    file.path_size = sizeof path_store[4];
+    if (toggle_is_blob) file.chunk_reader_f = read_blob;
+    else file.reader_f = read_value;
+    server->register_file(&file);
+}
+
+static void setup_files(mfs_server* server) {
+    for (unsigned int i = 0; i < FUZZ_KNOWN_PATHS; i++) {
+        memset(path_store[i], 'X', sizeof path_store[i]);
+        strcpy(path_store[i], known_paths[i]);
+    }
+    mfs_file_t file = {};
+    file.path = path_store[0];
+    file.path_size = sizeof path_store[0];
+    file.reader_f = read_value;
+    file.writer_f = write_value;
+    file.write_buffer = stored;
+    file.write_bsize = sizeof stored;
+    server->register_file(&file);
+
+    file = {};
+    file.path = path_store[1];
+    file.path_size = sizeof path_store[1];
+    file.chunk_reader_f = read_blob;
+    file.chunk_writer_f = write_blob;
+    server->register_file(&file);
+
+    file = {};
+    file.path = path_store[2];
+    file.path_size = sizeof path_store[2];
+    file.reader_f = read_failing;
+    server->register_file(&file);
+
+    memset(&derived, 0, sizeof derived);
+    derived.deps = derived_deps;
+    derived.deps_size = sizeof derived_deps;
+    derived.cache = derived_cache;
+    derived.cache_size = sizeof derived_cache;
+    file = {};
+    file.path = path_store[3];
+    file.path_size = sizeof path_store[3];
+    file.reader_ctx_f = compute_doubled;
+    file.derived = &derived;
+    server->register_file(&file);
+
+    toggle_is_blob = 0;
+    register_toggle(server);
+}
+
+// Checks (and consumes) everything the server wrote to client.
+static void check_output(client_t client) {
+    fuzz_pipe_t* p = &pipes[client];
+    unsigned int at = 0;
+    while (at < p->out_len) {
+        FUZZ_CHECK(p->out_len - at >= 9); // A frame cut short, the client would never get back in sync.
+        unsigned char* header = (unsigned char*)p->out + at;
+        unsigned int psize = header[0] | header[1] << 8 | header[2] << 16 | (unsigned int)header[3] << 24;
+        unsigned int dsize = header[4] | header[5] << 8 | header[6] << 16 | (unsigned int)header[7] << 24;
+        unsigned char op = header[8];
+        unsigned int trailer = p->crc ? 4 : 0;
+        FUZZ_CHECK(psize <= FUZZ_PATH_BSIZE);
+        FUZZ_CHECK((unsigned long long)psize + dsize + trailer <= p->out_len - at - 9);
+        FUZZ_CHECK(op & 0x80); // The server only ever answers.
+        char* path = p->out + at + 9;
+        char* data = path + psize;
+        if (psize != 0 && (op == RESPONSE_OF(OP_READ_MANY) || (op == RESPONSE_OF(OP_SUBSCRIBE) && dsize >= MFS_UPDATE_HEADER))) {
+            // Paths the server picked itself, they go out with exactly one terminator.
+            FUZZ_CHECK(strnlen(path, psize) == psize - 1);
+        }
+#if MFS_ENABLE_CRC
+        if (trailer != 0) {
+            unsigned int crc = mfs_crc32c(0, (char*)header, 9 + psize + dsize);
+            unsigned char* t = (unsigned char*)data + dsize;
+            FUZZ_CHECK(crc == (t[0] | t[1] << 8 | t[2] << 16 | (unsigned int)t[3] << 24));
+        }
+#endif
+        // The server switches to CRC framing right after answering OP_SETUP.
+        if (op == RESPONSE_OF(OP_SETUP) && dsize >= 15 && data[12] == MFS_SETUP_CRC) p->crc = data[14] != 0;
+        at += 9 + psize + dsize + trailer;
+    }
+    p->out_len = 0;
+}
+
+static void serve_pass(mfs_server* server) {
+    server->accept_clients();
+    server->serve_clients();
+    for (client_t c = 1; c <= FUZZ_CLIENTS; c++) {
+        check_output(c);
+        if (!pipes[c].open) pipes[c].crc = 0;
+    }
+    check_guards();
+}
+
+// Reads the next input byte, 0 once the input is used up.
+static unsigned char next_byte(const unsigned char* input, size_t size, size_t* at) {
+    return *at < size ? input[(*at)++] : 0;
+}
+
+static void send_bytes(client_t client, const char* bytes, unsigned int size) {
+    fuzz_pipe_t* p = &pipes[client];
+    if (size > sizeof p->in - p->in_len) size = sizeof p->in - p->in_len;
+    memcpy(p->in + p->in_len, bytes, size);
+    p->in_len += size;
+}
+
+// Builds a request from the input: op, path, data. Paths are usually one of the known ones, data is taken from the input as is.
+static void send_request(client_t client, const unsigned char* input, size_t size, size_t* at) {
+    unsigned char op = next_byte(input, size, at);
+    if (op < 0xE0) op %= 16; // Mostly real ops, now and then anything at all.
+    unsigned char selector = next_byte(input, size, at);
+    char path[FUZZ_PATH_BSIZE + 16];
+    unsigned int psize = 0;
+    if (selector < 0xC0) {
+        const char* known = known_paths[selector % FUZZ_KNOWN_PATHS];
+        psize = strlen(known) + 1;
+        memcpy(path, known, psize);
+        if (selector & 0x80) path[psize++] = 'Z'; // Junk after the terminator, still a valid path.
+    } else if (selector < 0xE0) {
+        path[psize++] = '\0'; // Empty path, what pathless requests send.
+    } else {
+        for (psize = 0; psize < (unsigned int)(selector - 0xE0) + 1 && psize < sizeof path; psize++) path[psize] = next_byte(input, size, at);
+    }
+    unsigned int dsize = next_byte(input, size, at) % (FUZZ_DATA_BSIZE + 32); // Sometimes too large for the data buffer.
+    char data[FUZZ_DATA_BSIZE + 32];
+    for (unsigned int i = 0; i < dsize; i++) data[i] = next_byte(input, size, at);
+
+    char header[9];
+    for (unsigned int i = 0; i < 4; i++) {
+        header[i] = (psize >> (8 * i)) & 0xFF;
+        header[4 + i] = (dsize >> (8 * i)) & 0xFF;
+    }
+    header[8] = op;
+    send_bytes(client, header, 9);
+    send_bytes(client, path, psize);
+    send_bytes(client, data, dsize);
+#if MFS_ENABLE_CRC
+    if (pipes[client].crc) {
+        // Keep the frame valid, a CRC mismatch drops the client (which is tested well enough by the garbage path.)
+        unsigned int crc = mfs_crc32c(0, header, 9);
+        crc = mfs_crc32c(crc, path, psize);
+        crc = mfs_crc32c(crc, data, dsize);
+        char trailer[4] = {(char)crc, (char)(crc >> 8), (char)(crc >> 16), (char)(crc >> 24)};
+        send_bytes(client, trailer, 4);
+    }
+#endif
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const unsigned char* input, size_t size) {
+    memset(&arena, 0xA5, sizeof arena);
+    memset(arena.clients, 0, sizeof arena.clients);
+    memset(arena.files, 0, sizeof arena.files);
+    memset(arena.transfers, 0, sizeof arena.transfers);
+    memset(arena.sessions, 0, sizeof arena.sessions);
+    memset(pipes, 0, sizeof pipes);
+    pending_accept = 0;
+    fuzz_now = 1000;
+    memcpy(value, "hello", 5);
+    value_len = 5;
+    for (unsigned int i = 0; i < sizeof blob; i++) blob[i] = (char)i;
+
+    mfs_server server(fuzz_read, fuzz_write, fuzz_accept, fuzz_close, fuzz_time, fuzz_available, arena.data, FUZZ_DATA_BSIZE, arena.path, FUZZ_PATH_BSIZE,
+                      arena.clients, FUZZ_CLIENTS, arena.files, FUZZ_FILES, arena.transfers, 2);
+#if MFS_ENABLE_LS
+    server.journal_buffer = arena.journal;
+    server.journal_bsize = sizeof arena.journal;
+#endif
+#if MFS_ENABLE_SUBSCRIBE
+    server.delta_buffer = arena.delta;
+    server.delta_bsize = sizeof arena.delta;
+#endif
+#if MFS_ENABLE_COALESCE
+    server.coalesce_buffer = arena.coalesce;
+    server.coalesce_bsize = sizeof arena.coalesce;
+#endif
+#if MFS_ENABLE_SESSIONS
+    server.enable_sessions(arena.sessions, 4);
+#endif
+    server.hard_limit = 512;
+    setup_files(&server);
+
+    size_t at = 0;
+    while (at < size) {
+        unsigned char command = input[at++];
+        client_t client = 1 + (command & 3) % FUZZ_CLIENTS;
+        fuzz_pipe_t* p = &pipes[client];
+        unsigned int kind = (command >> 2) & 7;
+        if (kind < 4) {
+            if (!p->open) {
+                // Not connected yet, connect instead.
+                if (!p->hung_up || pending_accept == 0) {
+                    memset(p, 0, sizeof *p);
+                    pending_accept = client;
+                }
+            } else {
+                send_request(client, input, size, &at);
+                // A well formed request has to be consumed completely, a pass reads at most one request per client.
+                for (unsigned int pass = 0; pass < 4 && p->open && p->in_len != 0; pass++) serve_pass(&server);
+                FUZZ_CHECK(!p->open || p->tainted || p->hung_up || p->in_len == 0);
+                continue;
+            }
+        } else if (kind == 4) {
+            // Garbage.
+            unsigned int n = next_byte(input, size, &at) % 32;
+            for (unsigned int i = 0; i < n; i++) {
+                char byte = next_byte(input, size, &at);
+                send_bytes(client, &byte, 1);
+            }
+            p->tainted = 1;
+        } else if (kind == 5) {
+            fuzz_now += next_byte(input, size, &at) * 64;
+        } else if (kind == 6) {
+            unsigned char action = next_byte(input, size, &at);
+            if (action % 3 == 0) {
+                value[0]++;
+                server.update_file(path_store[0], sizeof path_store[0], value_len);
+            } else if (action % 3 == 1) {
+                server.unregister_file(path_store[4], sizeof path_store[4]);
+                toggle_is_blob = !toggle_is_blob;
+                register_toggle(&server);
+            } else {
+                server.update_file(path_store[1], sizeof path_store[1], sizeof blob);
+            }
+        } else if (p->open) {
+            p->hung_up = 1;
+        }
+        serve_pass(&server);
+    }
+    // Let whatever is still streaming run to its end, the checks keep going.
+    for (unsigned int pass = 0; pass < 16; pass++) serve_pass(&server);
+    return 0;
+}
+
+#ifndef MFS_FUZZ_NO_MAIN
+static unsigned char* load_file(const char* name, size_t* size) {
+    FILE* f = fopen(name, "rb");
+    if (f == 0) return 0;
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    unsigned char* buffer = (unsigned char*)malloc(len > 0 ? len : 1);
+    *size = fread(buffer, 1, len > 0 ? len : 0, f);
+    fclose(f);
+    return buffer;
+}
+
+static double seconds() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Without libFuzzer: runs each file once (what AFL and crash reproduction need), or with -bench, the whole corpus over and over for that many seconds.
+// The corpus is loaded up front, the benchmark only times the server.
+int main(int argc, char** argv) {
+    double bench = 0;
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-bench") == 0) {
+        bench = atof(argv[2]);
+        first = 3;
+    }
+    int count = argc - first;
+    unsigned char** inputs = (unsigned char**)malloc(sizeof(unsigned char*) * (count > 0 ? count : 1));
+    size_t* sizes = (size_t*)malloc(sizeof(size_t) * (count > 0 ? count : 1));
+    for (int i = 0; i < count; i++) {
+        inputs[i] = load_file(argv[first + i], &sizes[i]);
+        if (inputs[i] == 0) {
+            fprintf(stderr, "can't read %s\n", argv[first + i]);
+            return 1;
+        }
+    }
+
+    unsigned long long runs = 0, bytes = 0;
+    double start = seconds();
+    do {
+        for (int i = 0; i < count; i++) {
+            LLVMFuzzerTestOneInput(inputs[i], sizes[i]);
+            runs++;
+            bytes += sizes[i];
+        }
+    } while (bench > 0 && count > 0 && seconds() - start < bench);
+    if (bench > 0) {
+        double elapsed = seconds() - start;
+        printf("%d inputs, %llu runs, %llu bytes in %.2f s: %.0f runs/s, %.2f MB/s\n", count, runs, bytes, elapsed, runs / elapsed, bytes / elapsed / 1e6);
+    }
+    for (int i = 0; i < count; i++) free(inputs[i]);
+    free(inputs);
+    free(sizes);
+    return 0;
+}
+#endif
@@ -3,9 +3,123 @@
 #define OP_WRITE 2
 #define OP_LS 3
 #define OP_ERROR 4
+#define OP_SETUP 5
+#define OP_CREDIT 6
+#define OP_CHUNK 7
+#define OP_RESUME 8
+#define OP_STAT 9
+#define OP_LS_STAT 10
+#define OP_READ_IF 11
+#define OP_SUBSCRIBE 12
+#define OP_LS_CHANGES 13
+#define OP_READ_MANY 14
 #define RESPONSE_OF(x) ((x) | 0x80)
 #define MFS_RESERVED_OP_RANGE 30
 
+// Feature configuration. Everything is on by default, define any of these as 0 (compiler flags, or a header named by MFS_CONFIG_HEADER) to strip it out.
+// Stripped ops are answered like any other unknown op in the reserved range (with a no-op), the same as a server that predates them.
+#ifdef MFS_CONFIG_HEADER
+#include MFS_CONFIG_HEADER
+#endif
+#ifndef MFS_ENABLE_LS
+#define MFS_ENABLE_LS 1 // OP_LS, both the full and the paginated form.
+#endif
+#ifndef MFS_ENABLE_WRITE
+#define MFS_ENABLE_WRITE 1 // OP_WRITE and OP_CHUNK uploads.
+#endif
+#ifndef MFS_ENABLE_STREAMING
+#define MFS_ENABLE_STREAMING 1 // Chunked reads, OP_SETUP, OP_CREDIT and OP_RESUME.
+#endif
+#ifndef MFS_ENABLE_STAT
+#define MFS_ENABLE_STAT 1 // OP_STAT, and OP_LS_STAT if OP_LS is enabled as well.
+#endif
+#ifndef MFS_ENABLE_READ_IF
+#define MFS_ENABLE_READ_IF 1 // OP_READ_IF, conditional reads for client side caches.
+#endif
+#ifndef MFS_ENABLE_CRC
+#define MFS_ENABLE_CRC 1 // CRC32C frame trailers, negotiated through OP_SETUP.
+#endif
+#ifndef MFS_CRC_SLICES
+#define MFS_CRC_SLICES 8 // Table size for the software CRC: 8 is slice-by-8 (8 KiB of flash, several times faster), 1 the classic bytewise table (1 KiB.) Unused when the CPU has CRC32C instructions.
+#endif
+#ifndef MFS_ENABLE_CAPTURE
+#define MFS_ENABLE_CAPTURE 1 // Session capture (the capture callback.)
+#endif
+#ifndef MFS_ENABLE_READ_MANY
+#define MFS_ENABLE_READ_MANY 1 // OP_READ_MANY, reading every file matching a prefix or glob with one request.
+#endif
+#ifndef MFS_ENABLE_SUBSCRIBE
+#define MFS_ENABLE_SUBSCRIBE 1 // OP_SUBSCRIBE, pushed updates (full or delta encoded) when a file changes.
+#endif
+#ifndef MFS_ENABLE_SPLIT
+#define MFS_ENABLE_SPLIT 1 // Split mode, running handlers on another core than the transport. See mfs_server::enable_split().
+#endif
+#ifndef MFS_ENABLE_EVENTS
+#define MFS_ENABLE_EVENTS 1 // ISR-safe notifications (mark_changed(), signal_readable(), wake()), see mfs_server::enable_events().
+#endif
+#ifndef MFS_ENABLE_HANDOFF
+#define MFS_ENABLE_HANDOFF 1 // Exporting and importing the server's state, for restarts without dropping clients. See mfs_server::export_state().
+#endif
+#ifndef MFS_ENABLE_SESSIONS
+#define MFS_ENABLE_SESSIONS 1 // Session resumption tokens (MFS_SETUP_SESSION), needs MFS_ENABLE_STREAMING for OP_SETUP.
+#endif
+#ifndef MFS_ENABLE_COALESCE
+#define MFS_ENABLE_COALESCE 1 // Sharing one reader call between identical reads in the same pass, see mfs_server::coalesce_buffer.
+#endif
+#ifndef MFS_ENABLE_DRAIN
+#define MFS_ENABLE_DRAIN 1 // Draining messages too large for our buffers. Without it, such clients are simply dropped.
+#endif
+
+// Invariant checks. Compiled out by default, fuzzing and debug builds can define it as something that traps (`#define MFS_ASSERT(x) if (!(x)) __builtin_trap()`).
+#ifndef MFS_ASSERT
+#define MFS_ASSERT(x)
+#endif
+
+// Setup keys. The data section of an OP_SETUP message is a list of [key (1 byte)][value lenght (1 byte)][value (little endian)] entries.
+#define MFS_SETUP_WINDOW 1 // How many chunks the server may send ahead before it needs more credit. 0 means no flow control.
+#define MFS_SETUP_CHUNK_SIZE 2 // Maximum payload of a chunk, only sent by the server.
+#define MFS_SETUP_CRC 3 // 1 to put a CRC32C trailer (4 bytes, little endian) after every frame, in both directions. Covers the header, path and data. mfs_client doesn't do trailers, it refuses to ask for them.
+#define MFS_SETUP_SESSION 4 // Session token (32 bit). 0 asks for a new session, a token from an earlier connection restores that session's window, CRC setting and subscription.
+                            // Send it first, the keys after it override what it restored. Answered with the session's (new) token, 0 if there is none to be had.
+
+// File attributes, as sent by OP_STAT: [flags (1 byte)][size (4 bytes)][version (4 bytes)][priority (1 byte)]
+#define MFS_STAT_SIZE 10
+#define MFS_STAT_READABLE 0x01
+#define MFS_STAT_WRITABLE 0x02
+#define MFS_STAT_STREAMING 0x04 // Reads are answered with OP_CHUNK streams.
+#define MFS_STAT_CHUNKED_WRITE 0x08 // Accepts OP_CHUNK uploads.
+
+// Registry changes, as sent by OP_LS_CHANGES: [generation (4 bytes)][kind (1 byte)][records], a record being [MFS_CHANGE_ADDED or MFS_CHANGE_REMOVED (1 byte)][NULL-terminated path].
+#define MFS_CHANGES_DELTA 0 // The records are the changes since the requested generation.
+#define MFS_CHANGES_FULL 1 // The generation aged out of the journal, the records list every file (all of them MFS_CHANGE_ADDED.) Replace the whole list.
+#define MFS_CHANGES_RELIST 2 // Neither fits the data buffer. No records, list the files with OP_LS and ask for changes since the generation sent here.
+#define MFS_CHANGE_REMOVED 0
+#define MFS_CHANGE_ADDED 1
+
+// First 4 bytes of the state written by mfs_server::export_state(), "MFSK". Bump it whenever the format changes.
+#define MFS_HANDOFF_MAGIC 0x4B53464D
+#define MFS_HANDOFF_LOST 0xFFFF // Path lenght of a file that got unregistered, see mfs_server::handoff_put_file().
+
+// Subscription modes, the data section of an OP_SUBSCRIBE request is [mode (1 byte)].
+#define MFS_SUBSCRIBE_OFF 0 // Unsubscribe.
+#define MFS_SUBSCRIBE_FULL 1 // Every update carries the whole payload.
+#define MFS_SUBSCRIBE_DELTA 2 // Updates are deltas against the previous one where possible, see mfs_server::delta_buffer.
+
+// Pushed updates are RESPONSE_OF(OP_SUBSCRIBE) messages with the file's path and [kind (1 byte)][base version (4 bytes)][version (4 bytes)][payload].
+// A full update's payload is the file's content. A delta's payload is [new lenght (4 bytes)][patches], only to be applied to a copy at the base version.
+// A patch is [skip (varint)][lenght (varint)][bytes]: skip bytes are kept as they are (counted from the end of the previous patch), lenght bytes are replaced.
+#define MFS_UPDATE_FULL 0
+#define MFS_UPDATE_DELTA 1
+#define MFS_UPDATE_HEADER 9
+
+// Capture record types. A capture is a sequence of [type (1 byte)][time delta in ms (varint)][client (varint)][payload size (varint)][payload] records.
+// Varints are little endian base 128, 7 bits per byte with the high bit set on every byte but the last.
+#define MFS_CAPTURE_DATA 0 // Bytes read from the client, exactly as the read callback returned them.
+#define MFS_CAPTURE_ACCEPT 1 // A new client, no payload.
+
+// client_handlers_t::stream_file of a stream whose file got unregistered mid-stream. The next pass tells the client with error 1000.
+#define MFS_STREAM_LOST 0xFFFFFFFF
+
 // An empty client's fd is always 0.
 typedef unsigned int client_t;
 
@@ -14,8 +128,50 @@ typedef struct {
     client_t client;
     unsigned long long timer_end;
 
+    // Chunked transfer state. All zero when there is no transfer going on.
+    unsigned int stream_file; // Index of the streamed file PLUS ONE, so 0 can mean "no stream". MFS_STREAM_LOST if the file got unregistered.
+    unsigned long long stream_offset; // How many bytes of the file have been sent so far.
+    unsigned int window; // Negotiated through OP_SETUP, 0 means the client did not ask for flow control.
+    unsigned int credit; // How many chunks we can still send before the client has to grant more.
+    unsigned int stream_transfer; // Index of the stream's entry in the transfer table PLUS ONE, 0 if the stream isn't resumable.
+
+    unsigned char crc; // Frames carry a CRC32C trailer, negotiated through OP_SETUP.
+
+    // Subscription state. All zero without a subscription.
+    unsigned int sub_file; // Index of the subscribed file PLUS ONE.
+    unsigned int sub_version; // Version of the file the client was last sent.
+    unsigned char sub_mode; // MFS_SUBSCRIBE_FULL or MFS_SUBSCRIBE_DELTA.
+    unsigned int sub_base; // Lenght of the last payload PLUS ONE when it is kept in the client's share of the delta buffer, 0 if there's no base for a delta.
+    unsigned int sub_deltas; // Deltas sent since the last full update.
+
+    unsigned int job; // Split mode: index of the client's job in flight PLUS ONE, 0 if there is none.
+    unsigned char ready; // Event driven mode: the client may have a request waiting, see mfs_server::signal_readable().
+    unsigned int session; // Index of the client's session PLUS ONE, 0 if it has none.
 } client_handlers_t;
 
+// A client's negotiated state, kept for a while after it disconnects so a reconnect can restore it with a single OP_SETUP. See MFS_SETUP_SESSION.
+typedef struct {
+    unsigned int token; // 0 if the slot is empty.
+    client_t owner; // Client currently holding the session, 0 while it is dormant.
+    unsigned long long expires; // When a dormant session can be reclaimed.
+
+    unsigned int window;
+    unsigned char crc;
+    unsigned int sub_file; // Index of the subscribed file PLUS ONE.
+    unsigned int sub_version;
+    unsigned char sub_mode;
+} mfs_session_t;
+
+// A resumable transfer. Outlives the client's connection for a while so the client can reconnect and continue where it left off.
+typedef struct {
+    unsigned int id; // 0 if the slot is empty.
+    unsigned int file; // Index of the file PLUS ONE.
+    unsigned char direction; // OP_READ or OP_WRITE.
+    unsigned long long committed; // Reads: offset the client acknowledged. Writes: offset handed to the chunk writer.
+    client_t owner; // Client currently driving the transfer, 0 while it is dormant.
+    unsigned long long expires; // When a dormant transfer can be reclaimed.
+} mfs_transfer_t;
+
 typedef struct {
     unsigned int psize;
     unsigned int dsize;
@@ -25,6 +181,33 @@ typedef struct {
     char* data;
 } mfs_message_t;
 
+// Lock-free single producer, single consumer queue of indices, for handing work between two cores. The slots are owned by the application.
+// head is only written by the producer and tail only by the consumer, so all it needs are acquire/release loads and stores.
+typedef struct {
+    unsigned int* slots;
+    unsigned int capacity;
+    unsigned int head; // Total pushed.
+    unsigned int tail; // Total popped.
+} mfs_spsc_t;
+
+// Pushes value, returns -1 if the queue is full. Producer side only.
+inline int mfs_spsc_push(mfs_spsc_t* queue, unsigned int value) {
+    unsigned int head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    if (head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == queue->capacity) return -1;
+    queue->slots[head % queue->capacity] = value;
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Pops into value, returns -1 if the queue is empty. Consumer side only.
+inline int mfs_spsc_pop(mfs_spsc_t* queue, unsigned int* value) {
+    unsigned int tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == tail) return -1;
+    *value = queue->slots[tail % queue->capacity];
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
 // POSIX style write, read and close functions.
 typedef long long(*write_cb)(client_t, char*, unsigned long long);
 typedef long long(*read_cb)(client_t, char*, unsigned long long);
@@ -33,6 +216,10 @@ typedef void (*setup_cb)(mfs_message_t);
 typedef unsigned long long (*available_cb)(client_t);
 typedef client_t (*accept_cb)(void);
 typedef unsigned long long (*get_time_cb)();
+typedef void (*capture_cb)(char*, unsigned int);
+typedef client_t (*connect_cb)(void);
+typedef client_t (*remap_cb)(client_t);
+typedef unsigned int (*crc_cb)(unsigned int, char*, unsigned long long);
 
 /*
     MANUAL OF CALLBACKS
@@ -43,6 +230,10 @@ typedef unsigned long long (*get_time_cb)();
     available_cb returns how much data (in bytes) is available from the client. **Should return 0 if the client's client_t is zero.**
     accept_cb accepts a new client to connect, returns 0 if theres no new clients.
     get_time_cb returns the current time since the MCU has started in milliseconds. (This is equivelent to the `millis()` function in arduino.)
+    crc_cb continues a CRC32C (Castagnoli) over a buffer: first arguement is the CRC so far (0 to start), then the buffer and its size. Returns the updated CRC.
+    It defaults to mfs_crc32c(), replace it to use a CRC peripheral.
+    connect_cb is only used by clients, it opens a new connection to the server and returns its identifier, 0 on failure.
+    capture_cb is optional, it receives the session capture as a stream of bytes (first arguement is the buffer, second is its size.) Write it to flash, a socket, wherever. It must not call back into the server.
 
     All of these functions should block until their tasks are finished, However it is recommended for implementors of these functions to make them time-out after the operation takes too long.
     The reason for this is their blocking nature, If the function blocks indefinitely, then the MCU would be deadlocked. and malicious clients could for example, send the headers of an MFS message, but never write the actual data and path
@@ -53,7 +244,37 @@ typedef unsigned long long (*get_time_cb)();
 // These functions are designated to be called by the corresponding file, and thus are responsible for returning an MFS message to send back to the client.
 typedef mfs_message_t (*fwrite_t)(mfs_message_t);
 typedef mfs_message_t (*fread_t)(mfs_message_t);
+// Same, but they also get the file's context pointer, its index in the file table and the client that asked. One handler serving many files can tell them apart without looking at the path.
+typedef mfs_message_t (*fwrite_ctx_t)(void* context, unsigned int file_index, client_t client, mfs_message_t request);
+typedef mfs_message_t (*fread_ctx_t)(void* context, unsigned int file_index, client_t client, mfs_message_t request);
+// Called before an OP_WRITE payload is received, returns where size bytes of payload should go (a DMA buffer, the file's own storage...)
+// Return NULL to have it go to the shared data buffer as usual.
+typedef char* (*fprepare_write_t)(void* context, unsigned int file_index, unsigned int size);
+// Chunked reader, for files that are too large to fit into the data buffer (logs, firmware images and such.)
+// Copies at most buffer_size bytes of the file starting at offset into buffer. Returns how many bytes it copied, 0 at the end of the file and -1 on error.
+typedef long long (*fchunk_read_t)(unsigned long long offset, char* buffer, unsigned int buffer_size);
+// Chunked writer, the counterpart of fchunk_read_t. Writes size bytes of buffer into the file at offset. Returns how many bytes it took, -1 on error.
+// Gets called with a size of 0 once the client finished the upload, so the file can commit it (verify and flash a firmware image for example.)
+typedef long long (*fchunk_write_t)(unsigned long long offset, char* buffer, unsigned int size);
+
+
+// State of a derived file, a file computed from other files (power from voltage and current, say.) See mfs_file_t::derived.
+// The application owns it and its buffers. All other fields should be zero initially.
+typedef struct {
+    char* deps; // Paths of the files this one is computed from, each NULL-terminated, back to back ("volt\0amp\0"). Derived files can depend on derived files.
+    unsigned int deps_size;
+    char* cache; // Last computed result. Results that don't fit are recomputed every time.
+    unsigned int cache_size;
+
+    unsigned int length; // Lenght of the cached result.
+    unsigned int computed_version; // Version of the file the cache is of.
+    unsigned char valid;
+} mfs_derived_t;
 
+// How deep a change propagates through derived files. Bounds the recursion, should the application build a dependency cycle.
+#ifndef MFS_DERIVED_DEPTH
+#define MFS_DERIVED_DEPTH 8
+#endif
 
 // All of the fields should be zero if its empty.
 typedef struct {
@@ -62,8 +283,134 @@ typedef struct {
 
     fwrite_t writer_f;
     fread_t reader_f;
+    fchunk_read_t chunk_reader_f; // Optional. If set, OP_READ on this file is answered with a stream of OP_CHUNK messages.
+    fchunk_write_t chunk_writer_f; // Optional. Lets clients upload the file in resumable OP_CHUNK pieces.
+
+    // Metadata, served by OP_STAT without calling any of the handlers above. Purely informational, the server never checks them.
+    unsigned int size; // Approximate size of the file in bytes, 0 if unknown.
+    unsigned int version; // Bumped every time the file changes, see mfs_server::update_file().
+    unsigned char priority; // Application defined.
+
+    // Optional context-aware handlers. If set, they are called instead of writer_f/reader_f.
+    void* context; // Handed to the handlers as is, the server never looks at it.
+    fwrite_ctx_t writer_ctx_f;
+    fread_ctx_t reader_ctx_f;
+
+    // Optional. Where OP_WRITE payloads should be received to, so writers don't have to copy them out of the shared data buffer.
+    // Writes larger than the data buffer are accepted as long as they fit here. prepare_write_f takes precedence over write_buffer.
+    // It is a staging buffer, NOT the file's storage: the payload lands in it before the writer runs, and a connection dropped mid-payload leaves it half overwritten.
+    // Only used for files with a writer, and not for clients with CRC trailers (their payload has to be checked before anything trusts it.)
+    char* write_buffer;
+    unsigned int write_bsize;
+    fprepare_write_t prepare_write_f;
+
+    // Optional. Makes this a derived file: a change to any of its dependencies bumps its version too, and the reader is only called
+    // when the version moved since the last call. Other reads are answered from the cache. Only plain reads are cached, reads with request data always call the reader.
+    mfs_derived_t* derived;
+
+    // Filled in by mfs_server::register_file(), so lookups and listings never have to walk the path again. Don't touch.
+    unsigned int path_len;
+    unsigned int path_hash;
 } mfs_file_t;
 
+// A handler call in flight between the I/O core and the handler core, see mfs_server::enable_split().
+// The application provides buffer and bsize, the server fills in the rest. The request and the handler's response are copied into the buffer,
+// so it has to hold the largest request plus its response ([request path][request data][response path][response data].)
+typedef struct {
+    char* buffer;
+    unsigned int bsize;
+
+    unsigned int client_index;
+    unsigned int file_index;
+    mfs_message_t request;
+    mfs_message_t response;
+    unsigned char in_use; // Only touched by the I/O core.
+
+    // The file's entry as of queue_job(). The handler core calls these and never looks at the client or file tables, which the I/O core keeps changing.
+    client_t client;
+    unsigned int version;
+    void* context;
+    fwrite_t writer_f;
+    fread_t reader_f;
+    fwrite_ctx_t writer_ctx_f;
+    fread_ctx_t reader_ctx_f;
+} mfs_job_t;
+
+#if MFS_ENABLE_CRC
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#elif !(defined(__SSE4_2__) && defined(__x86_64__))
+// Software tables, computed by the compiler so they end up in flash. mfs_crc_table.slice[k].v[b] is the CRC of byte b followed by k zero bytes.
+typedef struct {
+    unsigned int v[256];
+} mfs_crc_slice_t;
+
+typedef struct {
+    mfs_crc_slice_t slice[MFS_CRC_SLICES];
+} mfs_crc_table_t;
+
+// CRC of the low byte of v, one bit per step.
+constexpr unsigned int mfs_crc_byte(unsigned int v, unsigned int bits = 8) {
+    return bits == 0 ? v : mfs_crc_byte((v >> 1) ^ (0x82F63B78 & (0 - (v & 1))), bits - 1);
+}
+
+constexpr unsigned int mfs_crc_entry(unsigned int k, unsigned int b) {
+    return k == 0 ? mfs_crc_byte(b) : (mfs_crc_entry(k - 1, b) >> 8) ^ mfs_crc_byte(mfs_crc_entry(k - 1, b) & 0xFF);
+}
+
+// 0, 1, ... N - 1 as a template parameter pack, to spell out the tables' initializers.
+template <unsigned int... I> struct mfs_indices {};
+template <unsigned int N, unsigned int... I> struct mfs_make_indices : mfs_make_indices<N - 1, N - 1, I...> {};
+template <unsigned int... I> struct mfs_make_indices<0, I...> {
+    typedef mfs_indices<I...> type;
+};
+
+template <unsigned int K, unsigned int... B>
+constexpr mfs_crc_slice_t mfs_crc_make_slice(mfs_indices<B...>) {
+    return mfs_crc_slice_t{{mfs_crc_entry(K, B)...}};
+}
+
+template <unsigned int... K>
+constexpr mfs_crc_table_t mfs_crc_make_table(mfs_indices<K...>) {
+    return mfs_crc_table_t{{mfs_crc_make_slice<K>(mfs_make_indices<256>::type())...}};
+}
+
+static constexpr mfs_crc_table_t mfs_crc_table = mfs_crc_make_table(mfs_make_indices<MFS_CRC_SLICES>::type());
+#endif
+
+// CRC32C (Castagnoli, reflected polynomial 0x82F63B78) of size bytes of buffer, continuing from crc. Start with a crc of 0.
+// Uses the CRC32 instructions of SSE4.2 or ARMv8 when the compiler targets them, slice-by-MFS_CRC_SLICES tables otherwise.
+static unsigned int mfs_crc32c(unsigned int crc, char* buffer, unsigned long long size) {
+    unsigned char* p = (unsigned char*)buffer;
+    unsigned int c = ~crc;
+#if defined(__SSE4_2__) && defined(__x86_64__)
+    unsigned long long c64 = c;
+    for (; size >= 8; size -= 8, p += 8) {
+        unsigned long long word;
+        __builtin_memcpy(&word, p, 8);
+        c64 = __builtin_ia32_crc32di(c64, word);
+    }
+    c = (unsigned int)c64;
+    for (; size > 0; size--) c = __builtin_ia32_crc32qi(c, *p++);
+#elif defined(__ARM_FEATURE_CRC32)
+    for (; size >= 4; size -= 4, p += 4) c = __crc32cw(c, p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24));
+    for (; size > 0; size--) c = __crc32cb(c, *p++);
+#else
+    const mfs_crc_slice_t* table = mfs_crc_table.slice;
+#if MFS_CRC_SLICES == 8
+    for (; size >= 8; size -= 8, p += 8) {
+        unsigned int one = c ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24));
+        unsigned int two = p[4] | (p[5] << 8) | (p[6] << 16) | ((unsigned int)p[7] << 24);
+        c = table[7].v[one & 0xFF] ^ table[6].v[(one >> 8) & 0xFF] ^ table[5].v[(one >> 16) & 0xFF] ^ table[4].v[one >> 24]
+          ^ table[3].v[two & 0xFF] ^ table[2].v[(two >> 8) & 0xFF] ^ table[1].v[(two >> 16) & 0xFF] ^ table[0].v[two >> 24];
+    }
+#endif
+    for (; size > 0; size--) c = (c >> 8) ^ table[0].v[(c ^ *p++) & 0xFF];
+#endif
+    return ~c;
+}
+#endif
+
 // EXERCISE CAUTION!
 // This code is built for single-core MCUs. with built-in concurrency to handle multiple clients at the "same" time.
 // It is NOT thread-safe!
@@ -77,6 +424,14 @@ class mfs_server {
     client_handlers_t* clients;
     unsigned long long clients_len;
 
+    mfs_transfer_t* transfers;
+    unsigned int transfers_len;
+
+    mfs_session_t* sessions = 0;
+    unsigned int sessions_len = 0;
+    unsigned int token_state = 0; // xorshift32 state for session tokens.
+    unsigned int next_transfer_id = 1;
+
     mfs_file_t* files;
     unsigned int files_bsize;
 
@@ -87,6 +442,56 @@ class mfs_server {
     accept_cb accept_client;
     get_time_cb millis;
 
+    unsigned long long capture_last_time = 0; // Timestamp of the last capture record, capture times are stored as deltas.
+
+    // Coarse timestamp, sampled from millis() once per pass instead of once per client.
+    // Everything in the server that only needs millisecond-ish accuracy (timeouts mostly) should read this instead of calling millis().
+    unsigned long long now_ms = 0;
+
+#if MFS_ENABLE_LS
+    unsigned int generation = 0; // Bumped on every register_file() and unregister_file().
+    unsigned int journal_used = 0; // Bytes of the journal buffer in use.
+    unsigned int journal_floor = 0; // Oldest generation the journal can still answer "changes since" for.
+#endif
+
+#if MFS_ENABLE_SPLIT
+    mfs_job_t* jobs = 0; // Split mode is on when this isn't NULL.
+    unsigned int jobs_len = 0;
+    mfs_spsc_t job_requests; // I/O core to handler core.
+    mfs_spsc_t job_responses; // Handler core to I/O core.
+#endif
+
+#if MFS_ENABLE_EVENTS
+    // Bitsets written from interrupts: one bit per file slot (changed), followed by one bit per client slot (readable).
+    // Only ever touched with atomic read-modify-writes. Event driven mode is on when this isn't NULL.
+    unsigned int* event_bits = 0;
+    unsigned int file_event_words = 0;
+    unsigned int wake_flag = 0;
+
+    // Takes the events the interrupts posted since the last pass: changed files get their version bumped (and subscribers notified),
+    // readable clients get their next request read.
+    void drain_events() {
+        __atomic_store_n(&this->wake_flag, 0, __ATOMIC_RELAXED);
+        for (unsigned int w = 0; w < this->file_event_words; w++) {
+            unsigned int bits = __atomic_exchange_n(&this->event_bits[w], 0, __ATOMIC_ACQ_REL);
+            for (unsigned int b = 0; bits != 0; b++, bits >>= 1) {
+                unsigned int index = w * 32 + b;
+                if ((bits & 1) && index < this->files_bsize && !this->is_file_empty(index)) this->touch_file(index);
+            }
+        }
+        for (unsigned int w = 0; w * 32 < this->clients_len; w++) {
+            unsigned int bits = __atomic_exchange_n(&this->event_bits[this->file_event_words + w], 0, __ATOMIC_ACQ_REL);
+            for (unsigned int b = 0; bits != 0; b++, bits >>= 1) {
+                if ((bits & 1) && w * 32 + b < this->clients_len) this->clients[w * 32 + b].ready = 1;
+            }
+        }
+    }
+#endif
+
+#if MFS_ENABLE_COALESCE
+    unsigned int coalesce_used = 0; // Bytes of the coalesce buffer taken up by this pass' reads.
+#endif
+
 
     // Helper function to populate header buffers. WILL RESULT WITH BUFFER OVERFLOW IF THE BUFFER IS SMALLER THAN 9 ELEMENTS!
     void fill_headers(char* buffer, mfs_message_t msg) {
@@ -108,16 +513,16 @@ class mfs_server {
         msgptr->psize = 0;
         msgptr->dsize = 0;
 
-        // First, psize.
-        msgptr->psize |= (unsigned int)buffer[0];
-        msgptr->psize |= ((unsigned int)buffer[1] << 8);
-        msgptr->psize |= ((unsigned int)buffer[2] << 16);
-        msgptr->psize |= ((unsigned int)buffer[3] << 24);
+        // First, psize. (char can be signed, go through unsigned char or bytes above 0x7F get sign extended.)
+        msgptr->psize |= (unsigned int)(unsigned char)buffer[0];
+        msgptr->psize |= ((unsigned int)(unsigned char)buffer[1] << 8);
+        msgptr->psize |= ((unsigned int)(unsigned char)buffer[2] << 16);
+        msgptr->psize |= ((unsigned int)(unsigned char)buffer[3] << 24);
         // then dsize.
-        msgptr->dsize |= (unsigned int)buffer[4];
-        msgptr->dsize |= ((unsigned int)buffer[5] << 8);
-        msgptr->dsize |= ((unsigned int)buffer[6] << 16);
-        msgptr->dsize |= ((unsigned int)buffer[7] << 24);
+        msgptr->dsize |= (unsigned int)(unsigned char)buffer[4];
+        msgptr->dsize |= ((unsigned int)(unsigned char)buffer[5] << 8);
+        msgptr->dsize |= ((unsigned int)(unsigned char)buffer[6] << 16);
+        msgptr->dsize |= ((unsigned int)(unsigned char)buffer[7] << 24);
 
         msgptr->op = buffer[8];
     }
@@ -153,20 +558,245 @@ class mfs_server {
         }
     }
 
+    // Writes a 32 bit little endian integer into buffer. buffer should be at least 4 bytes.
+    void put_u32(char* buffer, unsigned int value) {
+        buffer[0] = value & 0xFF;
+        buffer[1] = (value >> 8) & 0xFF;
+        buffer[2] = (value >> 16) & 0xFF;
+        buffer[3] = (value >> 24) & 0xFF;
+    }
+
+    // Reads a little endian integer of size bytes (at most 4) from buffer.
+    unsigned int get_uint(char* buffer, unsigned int size) {
+        unsigned int value = 0;
+        for (unsigned int i = 0; i < size && i < 4; i++) {
+            value |= ((unsigned int)(unsigned char)buffer[i] << (8 * i));
+        }
+        return value;
+    }
+
+    // Matches path against a filter. A filter without any '*' or '?' is a plain prefix, otherwise it is a glob
+    // where '*' matches any run of characters (including '/') and '?' matches exactly one.
+    // Returns 1 on a match, 0 otherwise.
+    int path_matches(char* filter, unsigned int filter_len, char* path, unsigned int path_len) {
+        int is_glob = 0;
+        for (unsigned int i = 0; i < filter_len; i++) {
+            if (filter[i] == '*' || filter[i] == '?') {
+                is_glob = 1;
+                break;
+            }
+        }
+        if (!is_glob) {
+            if (filter_len > path_len) return 0;
+            return this->memcmp(filter, path, filter_len, filter_len) == 0;
+        }
+
+        // Classic greedy glob with a single backtrack point, no recursion so the stack stays flat.
+        unsigned int f = 0, p = 0;
+        unsigned int star = filter_len, star_p = 0; // star == filter_len means no '*' seen yet.
+        while (p < path_len) {
+            if (f < filter_len && (filter[f] == '?' || filter[f] == path[p])) {
+                f++;
+                p++;
+            } else if (f < filter_len && filter[f] == '*') {
+                star = f++;
+                star_p = p;
+            } else if (star != filter_len) {
+                f = star + 1;
+                p = ++star_p;
+            } else {
+                return 0;
+            }
+        }
+        while (f < filter_len && filter[f] == '*') f++;
+        return f == filter_len;
+    }
+
+    // Writes value as a varint into buffer, returns how many bytes it took. buffer should be at least 10 bytes.
+    unsigned int put_varint(char* buffer, unsigned long long value) {
+        unsigned int len = 0;
+        while (value >= 0x80) {
+            buffer[len++] = (value & 0x7F) | 0x80;
+            value >>= 7;
+        }
+        buffer[len++] = value;
+        return len;
+    }
+
+    // Hands a capture record to the capture callback. Header and payload are passed separately, so the payload is never copied.
+    void capture_record(unsigned char type, client_t client, char* payload, unsigned int size) {
+        char header[31]; // type + 3 varints
+        unsigned int len = 0;
+        header[len++] = type;
+        len += this->put_varint(header + len, this->now_ms - this->capture_last_time);
+        len += this->put_varint(header + len, client);
+        len += this->put_varint(header + len, size);
+        this->capture_last_time = this->now_ms;
+
+        this->capture(header, len);
+        if (size != 0) this->capture(payload, size);
+    }
+
+    // Every read from a client goes through here, it is the point where sessions get captured.
+    long long read_client(client_t client, char* buffer, unsigned long long size) {
+        long long result = this->client_reader(client, buffer, size);
+#if MFS_ENABLE_CAPTURE
+        if (this->capture != 0 && result > 0) this->capture_record(MFS_CAPTURE_DATA, client, buffer, result);
+#endif
+        return result;
+    }
+
+    // Finds the slot of client, NULL if it isn't connected.
+    client_handlers_t* find_client(client_t client) {
+        if (client == 0) return 0;
+        for (unsigned long long i = 0; i < this->clients_len; i++) {
+            if (this->clients[i].client == client) return &this->clients[i];
+        }
+        return 0;
+    }
+
+    // Returns 1 if frames to and from client carry a CRC trailer.
+#if MFS_ENABLE_CRC
+    int client_uses_crc(client_t client) {
+        client_handlers_t* slot = this->find_client(client);
+        return slot != 0 && slot->crc;
+    }
+#else
+    int client_uses_crc(client_t /*client*/) {
+        return 0;
+    }
+#endif
+
+    // Writes the CRC trailer of a frame. Drops the client on failure, returns -1 on error and 0 on success.
+    int send_crc(client_t client, unsigned int crc) {
+        char trailer[4];
+        this->put_u32(trailer, crc);
+        if (this->client_writer(client, trailer, 4) != 4) {
+            this->drop_client(client);
+            return -1;
+        }
+        return 0;
+    }
+
+    // Validates, measures and hashes a path in one pass. path_size is the size of the buffer, the path has to be NULL-terminated within it.
+    // Works on 4 bytes at a time: a word without a terminator (or, with strict_paths, a control character) gets hashed as a whole, only the last word is looked at byte by byte.
+    // Returns the lenght of the path (without the terminator), -1 if it is empty, unterminated or has illegal characters.
+    long long scan_path(char* path, unsigned int path_size, unsigned int* hash) {
+        unsigned int h = 2166136261u; // FNV offset basis, the mixing is FNV-1a but a word at a time.
+        unsigned int stop = this->strict_paths ? 0x20202020 : 0x01010101; // Any byte below this ends the fast loop.
+        unsigned int i = 0;
+        for (; i + 4 <= path_size; i += 4) {
+            unsigned int word;
+            __builtin_memcpy(&word, path + i, 4);
+            if ((word - stop) & ~word & 0x80808080) break; // Has a byte below stop in it. (The classic "has zero byte" trick, generalised.)
+            h = (h ^ word) * 16777619u;
+        }
+        // The last (partial) word. Less than 4 path bytes are left before the terminator if the path is valid.
+        unsigned int tail = 0;
+        for (unsigned int shift = 0; i < path_size; i++, shift += 8) {
+            unsigned char c = path[i];
+            if (c == '\0') {
+                if (i == 0) return -1; // Empty path.
+                h = (h ^ tail) * 16777619u;
+                *hash = h ^ i;
+                return i;
+            }
+            if (c < 0x20 && this->strict_paths) return -1;
+            if (shift == 32) return -1; // Only possible if path_size cut a word short of the terminator, which means there is none.
+            tail |= (unsigned int)c << shift;
+        }
+        return -1; // No terminator.
+    }
+
     // Gets the index of file at path.
     // Returns the index, returns -1 if the file isn't found.
-    // psize should be lenght of the string inside the path array. (Its not a C-string, just specifices how long the string is without a terminator)
-    long long get_file_index(char* path, unsigned int psize) {
-        for (unsigned int i = 0; i < psize; i++) {
-            if (path[i] == '\0') return -1; // Illegal character.
-        }
+    // path_size is the size of the path buffer, the path has to be NULL-terminated within it. (Paths on the wire are sent with their terminator for this reason.)
+    long long get_file_index(char* path, unsigned int path_size) {
+        unsigned int hash;
+        long long len = this->scan_path(path, path_size, &hash);
+        if (len == -1) return -1;
 
         for (unsigned int i = 0; i < this->files_bsize; i++) {
-            if (this->memcmp(path, this->files[i].path, psize, this->strlen(this->files[i].path, this->files[i].path_size))) continue;
+            // Hash and lenght filter out almost everything, the compare only runs on the (likely) match.
+            if (this->files[i].path_hash != hash || this->files[i].path_len != len) continue;
+            if (this->memcmp(path, this->files[i].path, len, len)) continue;
             return i;
         }
         return -1;
+    }
+
+    // Samples the clock into now_ms. Call this once per pass, NOT once per client.
+    // get_time_cb can be a syscall or a locked RTC read on some platforms, so calling it in a loop adds up.
+    void refresh_clock() {
+        this->now_ms = this->millis();
+    }
+
+    // Finds a transfer by its id. Returns NULL if there is no such transfer (or it expired.)
+    mfs_transfer_t* find_transfer(unsigned int id) {
+        if (id == 0) return 0;
+        for (unsigned int i = 0; i < this->transfers_len; i++) {
+            mfs_transfer_t* t = &this->transfers[i];
+            if (t->id != id) continue;
+            if (t->owner == 0 && t->expires <= this->now_ms) return 0; // Dormant for too long.
+            return t;
+        }
+        return 0;
+    }
+
+    // Allocates a new transfer for file_index. Reclaims expired dormant transfers if needed.
+    // Returns NULL if the table is full (or there is no table.)
+    mfs_transfer_t* open_transfer(unsigned int file_index, unsigned char direction, client_t owner) {
+        for (unsigned int i = 0; i < this->transfers_len; i++) {
+            mfs_transfer_t* t = &this->transfers[i];
+            if (t->id != 0 && !(t->owner == 0 && t->expires <= this->now_ms)) continue;
+
+            t->id = this->next_transfer_id++;
+            if (this->next_transfer_id == 0) this->next_transfer_id = 1; // 0 means empty, skip it on wrap around.
+            t->file = file_index + 1;
+            t->direction = direction;
+            t->committed = 0;
+            t->owner = owner;
+            t->expires = 0;
+            return t;
+        }
+        return 0;
+    }
+
+    // Ends the client's stream. The transfer (if any) is left dormant, so the client can still resume it if the tail got lost.
+    void end_stream(client_handlers_t* client) {
+        if (client->stream_transfer != 0) {
+            mfs_transfer_t* t = &this->transfers[client->stream_transfer - 1];
+            t->owner = 0;
+            t->expires = this->now_ms + this->transfer_ttl_ms;
+        }
+        client->stream_file = 0;
+        client->stream_offset = 0;
+        client->stream_transfer = 0;
+    }
 
+    // Drops whatever refers to file_index by its slot, before the slot is emptied. A file registered in the same slot later must not inherit it.
+    // Transfers are ended (resuming them fails with 3005), streams are flagged as lost and abort on their next pass.
+    // Subscriptions end quietly, live or kept in a dormant session.
+    void forget_file(unsigned int file_index) {
+        for (unsigned int i = 0; i < this->transfers_len; i++) {
+            if (this->transfers[i].file == file_index + 1) this->transfers[i].id = 0;
+        }
+        for (unsigned int i = 0; i < this->clients_len; i++) {
+            client_handlers_t* client = &this->clients[i];
+            if (client->stream_file == file_index + 1) {
+                client->stream_file = MFS_STREAM_LOST;
+                client->stream_transfer = 0;
+            }
+            if (client->sub_file == file_index + 1) {
+                client->sub_file = 0;
+                client->sub_base = 0;
+            }
+        }
+#if MFS_ENABLE_SESSIONS
+        for (unsigned int i = 0; i < this->sessions_len; i++) {
+            if (this->sessions[i].sub_file == file_index + 1) this->sessions[i].sub_file = 0;
+        }
+#endif
     }
 
     // closes client and removes them from the concurrent client list.
@@ -175,11 +805,41 @@ class mfs_server {
     int drop_client(client_t client) {
         if (client == 0) return 0; // empty client descriptor
         client_handlers_t* clients = this->clients;
-        char is_client_found = 0;
         for (unsigned long long i = 0; i < this->clients_len; i++) {
             if (client == clients[i].client) {
                 this->client_killer(clients[i].client);
                 clients[i].client = 0;
+#if MFS_ENABLE_SESSIONS
+                // Its session goes dormant, with what it negotiated.
+                if (clients[i].session != 0) {
+                    mfs_session_t* session = &this->sessions[clients[i].session - 1];
+                    session->owner = 0;
+                    session->expires = this->now_ms + this->session_ttl_ms;
+                    session->window = clients[i].window;
+                    session->crc = clients[i].crc;
+                    session->sub_file = clients[i].sub_file;
+                    session->sub_version = clients[i].sub_version;
+                    session->sub_mode = clients[i].sub_mode;
+                    clients[i].session = 0;
+                }
+#endif
+                // Forget about any transfer, the next client in this slot starts clean.
+                this->end_stream(&clients[i]);
+                clients[i].window = 0;
+                clients[i].credit = 0;
+                clients[i].crc = 0;
+                clients[i].sub_file = 0;
+                clients[i].sub_mode = 0;
+                clients[i].sub_base = 0;
+                clients[i].job = 0; // Its job is discarded when it comes back.
+#if MFS_ENABLE_STREAMING || MFS_ENABLE_WRITE
+                // Resumable transfers go dormant, the client may come back for them.
+                for (unsigned int j = 0; j < this->transfers_len; j++) {
+                    if (this->transfers[j].owner != client) continue;
+                    this->transfers[j].owner = 0;
+                    this->transfers[j].expires = this->now_ms + this->transfer_ttl_ms;
+                }
+#endif
                 return 0;
             }
         }
@@ -190,17 +850,118 @@ class mfs_server {
     // checks if the file at index is empty.
     // returns 1 if it is empty, 0 if its filled.
     int is_file_empty(unsigned int index) {
-        int result = 0;
-        if (this->files[index].path_size == 0 && this->files[index].path == 0 && this->files[index].reader_f == 0 && this->files[index].writer_f == 0) return 1;
+        if (this->files[index].path_size == 0 && this->files[index].path == 0 && !this->has_reader(index) && !this->has_writer(index) && this->files[index].chunk_reader_f == 0 && this->files[index].chunk_writer_f == 0) return 1;
+        return 0;
+    }
+
+    // Returns 1 if the file at index has a (non-chunked) reader, plain or context-aware.
+    int has_reader(unsigned int index) {
+        return this->files[index].reader_f != 0 || this->files[index].reader_ctx_f != 0;
+    }
+
+    // Returns 1 if the file at index has a (non-chunked) writer, plain or context-aware.
+    int has_writer(unsigned int index) {
+        return this->files[index].writer_f != 0 || this->files[index].writer_ctx_f != 0;
+    }
+
+    // Returns 1 in split mode, where handlers only ever run on the handler core. See enable_split().
+    int split_mode() {
+#if MFS_ENABLE_SPLIT
+        return this->jobs != 0;
+#else
+        return 0;
+#endif
+    }
+
+    // Calls the reader of the file at index. Check has_reader() first.
+    // Derived files are answered from their cache while it is current, see mfs_file_t::derived.
+    mfs_message_t call_reader(unsigned int index, client_t client, mfs_message_t request) {
+        mfs_file_t* file = &this->files[index];
+        if (this->cached_read(index, &request)) return request;
+        mfs_message_t response;
+        if (file->reader_ctx_f != 0) response = file->reader_ctx_f(file->context, index, client, request);
+        else response = file->reader_f(request);
+        this->cache_read(index, file->version, request, response);
+        return response;
+    }
+
+    // Turns request into the cached response if the file at index is a derived file with a current cache. Returns 1 if it did, 0 if the reader has to run.
+    int cached_read(unsigned int index, mfs_message_t* request) {
+        mfs_derived_t* derived = this->files[index].derived;
+        if (derived == 0 || request->dsize != 0 || !derived->valid || derived->computed_version != this->files[index].version) return 0;
+        request->op = RESPONSE_OF(OP_READ);
+        request->data = derived->cache;
+        request->dsize = derived->length;
+        return 1;
+    }
+
+    // Keeps the reader's response to request as the cache of the derived file at index, computed from the file's version.
+    void cache_read(unsigned int index, unsigned int version, mfs_message_t request, mfs_message_t response) {
+        mfs_derived_t* derived = this->files[index].derived;
+        if (derived == 0 || request.dsize != 0) return;
+        derived->valid = 0;
+        if (response.op == RESPONSE_OF(OP_READ) && response.dsize <= derived->cache_size) {
+            this->memcpy(response.dsize, response.data, derived->cache, 0);
+            derived->length = response.dsize;
+            derived->computed_version = version;
+            derived->valid = 1;
+        }
+    }
+
+    // Returns 1 if the derived file at index lists the file at dep_index as a dependency.
+    int depends_on(unsigned int index, unsigned int dep_index) {
+        mfs_derived_t* derived = this->files[index].derived;
+        mfs_file_t* dep = &this->files[dep_index];
+        for (unsigned int at = 0; at < derived->deps_size;) {
+            unsigned int len = this->strlen(derived->deps + at, derived->deps_size - at);
+            if (len == 0) break;
+            if (this->memcmp(derived->deps + at, dep->path, len, dep->path_len) == 0) return 1;
+            at += len + 1;
+        }
         return 0;
     }
 
+    // Bumps the version of the file at index, and of every derived file depending on it (directly, or through other derived files.)
+    // Everything that marks a file as changed goes through here.
+    void touch_file(unsigned int index, unsigned int depth = 0) {
+        this->files[index].version++;
+        if (depth >= MFS_DERIVED_DEPTH) return;
+        for (unsigned int i = 0; i < this->files_bsize; i++) {
+            if (this->files[i].derived == 0 || i == index || this->files[i].path_len == 0) continue;
+            if (this->depends_on(i, index)) this->touch_file(i, depth + 1);
+        }
+    }
+
+    // Calls the writer of the file at index. Check has_writer() first.
+    mfs_message_t call_writer(unsigned int index, client_t client, mfs_message_t request) {
+        mfs_file_t* file = &this->files[index];
+        if (file->writer_ctx_f != 0) return file->writer_ctx_f(file->context, index, client, request);
+        return file->writer_f(request);
+    }
+
+#if MFS_ENABLE_WRITE
+    // Handles OP_WRITE. Only a write the writer took bumps the file's version, a refused one didn't change anything.
+    void write_file(client_t client, unsigned int file_index, mfs_message_t request) {
+        mfs_message_t response = this->call_writer(file_index, client, request);
+        this->send_mfs_message(response, client);
+        if (response.op == RESPONSE_OF(OP_WRITE)) this->touch_file(file_index);
+    }
+#endif
+
     // Sends MFS message, returns -1 on error, 0 on success.
     // DROPS CLIENTS IF WRITING FAILS!
     int send_mfs_message(mfs_message_t msg, client_t client) {
+        return this->send_mfs_message_prefixed(msg, 0, 0, client);
+    }
+
+    // Same as send_mfs_message(), but the data section starts with prefix_size bytes of prefix followed by msg.data.
+    // Saves copying a handler's response around just to put a few bytes in front of it.
+    int send_mfs_message_prefixed(mfs_message_t msg, char* prefix, unsigned int prefix_size, client_t client) {
         // First, build up first 9 byte buffer to send for headers.
         char buffer[9];
+        msg.dsize += prefix_size;
         this->fill_headers(buffer, msg);
+        msg.dsize -= prefix_size;
         // and then write
         if (this->client_writer(client, buffer, 9) != 9) {
             // So, we can't write headers to client, in this case we are toast! drop client.
@@ -214,11 +975,26 @@ class mfs_server {
             return -1;
         }
 
+        if (prefix_size != 0 && this->client_writer(client, prefix, prefix_size) != prefix_size) {
+            // Failure, drop client.
+            this->drop_client(client);
+            return -1;
+        }
+
         if (this->client_writer(client, msg.data, msg.dsize) != msg.dsize) {
             // Failure, drop client.
             this->drop_client(client);
             return -1;
         }
+#if MFS_ENABLE_CRC
+        if (this->client_uses_crc(client)) {
+            unsigned int crc = this->crc_f(0, buffer, 9);
+            crc = this->crc_f(crc, msg.path, msg.psize);
+            if (prefix_size != 0) crc = this->crc_f(crc, prefix, prefix_size);
+            crc = this->crc_f(crc, msg.data, msg.dsize);
+            return this->send_crc(client, crc);
+        }
+#endif
         return 0;
     }
 
@@ -240,14 +1016,60 @@ class mfs_server {
         return this->send_mfs_message(msg, client);
     }
 
+    // Fixed size responses (OP_SETUP, OP_STAT, stream and transfer headers...) are built in the data buffer, which can be tiny on an MCU.
+    // Returns 1 if size bytes fit, otherwise answers request with error 1 (too large) and returns 0.
+    int response_fits(mfs_message_t request, client_t client, unsigned int size) {
+        if (size <= this->data_bsize) return 1;
+        this->send_mfs_error(request, client, 1);
+        return 0;
+    }
+
+    // Reads and throws away size bytes from client, in data buffer sized chunks. Used to get past messages we can't take.
+    // Returns 0 on success, -1 if reading failed. The client is dropped in that case.
+    int drain_client(client_t client, unsigned long long size) {
+        unsigned int chunk_size = 0;
+        for (unsigned long long processed_data = 0; processed_data < size;) {
+            if ((size - processed_data) > this->data_bsize) chunk_size = this->data_bsize;
+            else chunk_size = (size - processed_data);
+
+            // Read chunk
+            if (this->read_client(client, this->data_buffer, chunk_size) != chunk_size) {
+                // So, this is a really bad situation. We wanna consume data, yet we can't.
+                // Drop client.
+                this->drop_client(client);
+                return -1;
+            }
+
+            processed_data += chunk_size;
+        }
+        return 0;
+    }
+
+    // Picks where the payload of an OP_WRITE to the file at index goes. Returns the file's own buffer if it has one that fits, NULL for the shared data buffer.
+    char* write_destination(long long index, unsigned int size) {
+        if (index < 0 || !this->has_writer(index)) return 0; // The write is going to be refused, leave the file's buffer alone.
+        if (this->split_mode()) return 0; // prepare_write_f is a handler too. The payload is copied into a job anyway.
+        mfs_file_t* file = &this->files[index];
+        if (file->prepare_write_f != 0) return file->prepare_write_f(file->context, index, size);
+        if (file->write_buffer != 0 && size <= file->write_bsize) return file->write_buffer;
+        return 0;
+    }
+
     // Reads MFS message, sends error to client if the data and/or psize is larger than the buffers.
-    // On error, returns a MFS message struct with all (except op) as zero, and the pointers as NULL.
+    // On error, returns a MFS message struct with all (except op) as zero, and the pointers as NULL. The client is out of sync at that point.
+    // A message that was too large for our buffers is drained and rejected, the client stays in sync. That returns an OP_ERROR response with empty (but not NULL) path and data.
+    // OP_WRITE payloads go straight into the file's own buffer if it has one (see mfs_file_t::write_buffer), which saves a copy and lets writes be larger than the data buffer.
+    // Not for files without a writer, or for clients with CRC trailers: their payload goes to the data buffer and is checked there.
+    // To pick the buffer the file is looked up here already, file_index gets its index (-1 if it doesn't exist.) It is -2 if there was no lookup.
     // Can drop clients if erroring out errors out, Or if the client's request exceeds hard limits.
-    mfs_message_t read_mfs_message(client_t client) {
+    mfs_message_t read_mfs_message(client_t client, long long* file_index) {
         char buffer[9];
         mfs_message_t empty_error_msg = {.psize = 0, .dsize = 0, .op = RESPONSE_OF(OP_ERROR), .path = 0, .data = 0};
+        mfs_message_t rejected_msg = {.psize = 0, .dsize = 0, .op = RESPONSE_OF(OP_ERROR), .path = this->path_buffer, .data = this->data_buffer};
         mfs_message_t result;
-        if (this->client_reader(client, buffer, 9) != 9) {
+        int uses_crc = this->client_uses_crc(client);
+        *file_index = -2;
+        if (this->read_client(client, buffer, 9) != 9) {
             // Can't read headers.
             this->send_mfs_error(empty_error_msg, client, 3);
             return empty_error_msg;
@@ -258,65 +1080,402 @@ class mfs_server {
             this->drop_client(client);
             return empty_error_msg;
         }
+        int direct_write = 0;
+#if MFS_ENABLE_WRITE
+        direct_write = result.op == OP_WRITE;
+#endif
 
         // ===================CONSUME DATA IF DATA OR PATH SIZE IS TOO LARGE====================
         // Now, check if dsize or psize exceed limits. If so, consume the data and send error to client.
-        if (result.psize > this->path_bsize || result.dsize > this->data_bsize) {
-            // Consume the path.
-            unsigned int chunk_size = 0;
-
-            for (unsigned int processed_data = 0; processed_data < result.psize;) {
-                if ((result.psize - processed_data) > this->path_bsize) chunk_size = this->path_bsize;
-                else chunk_size = (result.psize - processed_data);
-
-                // Read chunk
-                if (this->client_reader(client, this->path_buffer, chunk_size) != chunk_size) {
-                    // So, this is a really bad situation. We wanna consume data, yet we can't.
-                    // Drop client.
-                    this->drop_client(client);
-                }
-
-                processed_data += chunk_size;
-                break;
-            }
-
-            chunk_size = 0;
-            // Same for data
-            for (unsigned int processed_data = 0; processed_data < result.dsize;) {
-                if ((result.dsize - processed_data) > this->data_bsize) chunk_size = this->data_bsize;
-                else chunk_size = (result.dsize - processed_data);
-
-                // Read chunk
-                if (this->client_reader(client, this->data_buffer, chunk_size) != chunk_size) {
-                    // So, this is a really bad situation. We wanna consume data, yet we can't.
-                    // Drop client.
-                    this->drop_client(client);
-                    break;
-                }
-
-                processed_data += chunk_size;
-            }
-            this->send_mfs_error(empty_error_msg, client, 001);
+        // A write's payload might fit into its file's buffer, that is decided once we know the file.
+        if (result.psize > this->path_bsize || (result.dsize > this->data_bsize && !direct_write)) {
+#if !MFS_ENABLE_DRAIN
+            // Draining is compiled out, we can't get back in sync.
+            this->drop_client(client);
             return empty_error_msg;
+#endif
+            // Consume the path and data, and the CRC trailer if there is one. No point in checking it, the message is rejected anyway.
+            if (this->drain_client(client, (unsigned long long)result.psize + result.dsize + (uses_crc ? 4 : 0)) != 0) return empty_error_msg;
+            // Everything got consumed, so the client is still in sync. Reject the message but keep the client.
+            if (this->send_mfs_error(empty_error_msg, client, 001) != 0) return empty_error_msg;
+            return rejected_msg;
         }
         //========================================================================================
 
-        // Here, we are ABSOLUTELY sure the data and path can fit into our buffers.
+        // Here, we are ABSOLUTELY sure the path can fit into our buffer.
         // Read path first (as defined by specification) and then data.
-        if (this->client_reader(client, this->path_buffer, result.psize) != result.psize) {
+        if (this->read_client(client, this->path_buffer, result.psize) != result.psize) {
             this->send_mfs_error(empty_error_msg, client, 001);
             return empty_error_msg;
         }
-        if (this->client_reader(client, this->data_buffer, result.dsize) != result.dsize) {
+
+        char* destination = 0;
+        if (direct_write && !uses_crc) {
+            *file_index = this->get_file_index(this->path_buffer, result.psize);
+            destination = this->write_destination(*file_index, result.dsize);
+        }
+        if (destination == 0) {
+            destination = this->data_buffer;
+            if (result.dsize > this->data_bsize) {
+                // A write that doesn't fit anywhere.
+#if !MFS_ENABLE_DRAIN
+                this->drop_client(client);
+                return empty_error_msg;
+#endif
+                if (this->drain_client(client, (unsigned long long)result.dsize + (uses_crc ? 4 : 0)) != 0) return empty_error_msg;
+                if (this->send_mfs_error(empty_error_msg, client, 001) != 0) return empty_error_msg;
+                return rejected_msg;
+            }
+        }
+
+        if (this->read_client(client, destination, result.dsize) != result.dsize) {
             this->send_mfs_error(empty_error_msg, client, 001);
             return empty_error_msg;
         }
+#if MFS_ENABLE_CRC
+        if (uses_crc) {
+            char trailer[4];
+            if (this->read_client(client, trailer, 4) != 4) {
+                this->send_mfs_error(empty_error_msg, client, 001);
+                return empty_error_msg;
+            }
+            unsigned int crc = this->crc_f(0, buffer, 9);
+            crc = this->crc_f(crc, this->path_buffer, result.psize);
+            crc = this->crc_f(crc, destination, result.dsize);
+            if (crc != this->get_uint(trailer, 4)) {
+                // Corrupted on the way. The sizes could be what got corrupted, but if they were we'd have failed (or will fail) on the next read anyway.
+                if (this->send_mfs_error(empty_error_msg, client, 3008) != 0) return empty_error_msg;
+                return rejected_msg;
+            }
+        }
+#endif
+        MFS_ASSERT(result.psize <= this->path_bsize && (destination != this->data_buffer || result.dsize <= this->data_bsize));
         // Finally, we can return the result. and change the pointers on the result struct.
-        result.data = this->data_buffer;
+        result.data = destination;
         result.path = this->path_buffer;
         return result;
     }
 
+    // Writes the attributes of the file at index into buffer. buffer should be at least MFS_STAT_SIZE bytes.
+    void fill_stat(char* buffer, unsigned int index) {
+        mfs_file_t* file = &this->files[index];
+        unsigned char flags = 0;
+        if (this->has_reader(index) || file->chunk_reader_f != 0) flags |= MFS_STAT_READABLE;
+        if (this->has_writer(index) || file->chunk_writer_f != 0) flags |= MFS_STAT_WRITABLE;
+        if (file->chunk_reader_f != 0) flags |= MFS_STAT_STREAMING;
+        if (file->chunk_writer_f != 0) flags |= MFS_STAT_CHUNKED_WRITE;
+
+        buffer[0] = flags;
+        this->put_u32(buffer + 1, file->size);
+        this->put_u32(buffer + 5, file->version);
+        buffer[9] = file->priority;
+    }
+
+    // Answers OP_STAT from the file's metadata. The path is echoed back, the data section is the stat record.
+    void stat_file(client_t client, unsigned int file_index, mfs_message_t request) {
+        if (!this->response_fits(request, client, MFS_STAT_SIZE)) return;
+        this->fill_stat(this->data_buffer, file_index);
+        request.op = RESPONSE_OF(OP_STAT);
+        request.dsize = MFS_STAT_SIZE;
+        request.data = this->data_buffer;
+        this->send_mfs_message(request, client);
+    }
+
+    // Answers OP_READ_IF, a read that only calls the reader if the client's copy is out of date.
+    // The request's data section is [conditional (1 byte)][version (4 bytes)][data for the reader]. With conditional set and a matching version, the reader isn't called at all.
+    // The response's data section is [modified (1 byte)][current version (4 bytes)][payload], there is no payload if modified is 0.
+    // Files with a version of 0 have never been touched through update_file() or a write, so we can't tell if they changed. Those are always sent in full.
+    void conditional_read(unsigned int client_index, unsigned int file_index, mfs_message_t request) {
+        client_t client = this->clients[client_index].client;
+        mfs_file_t* file = &this->files[file_index];
+        if (request.dsize < 5) {
+            this->send_mfs_error(request, client, 3006);
+            return;
+        }
+        if (!this->has_reader(file_index)) {
+            this->send_mfs_error(request, client, 1002);
+            return;
+        }
+        char prefix[5];
+        prefix[0] = 1;
+        this->put_u32(prefix + 1, file->version);
+
+        if (request.data[0] != 0 && file->version != 0 && this->get_uint(request.data + 1, 4) == file->version) {
+            // Client is up to date.
+            prefix[0] = 0;
+            request.op = RESPONSE_OF(OP_READ_IF);
+            request.dsize = 0;
+            this->send_mfs_message_prefixed(request, prefix, 5, client);
+            return;
+        }
+
+        mfs_message_t reader_request = request;
+        reader_request.data += 5;
+        reader_request.dsize -= 5;
+#if MFS_ENABLE_SPLIT
+        if (this->jobs != 0) {
+            // The reader runs on the handler core, complete_jobs() sends its response. A derived file's cache hit is answered right here.
+            mfs_message_t cached = reader_request;
+            if (this->cached_read(file_index, &cached)) this->send_conditional(client, file->version, cached);
+            else this->queue_job(client_index, file_index, request);
+            return;
+        }
+#endif
+        this->send_conditional(client, file->version, this->shared_read(file_index, client, reader_request));
+    }
+
+    // Sends the reader's response to an OP_READ_IF, as modified at version.
+    void send_conditional(client_t client, unsigned int version, mfs_message_t response) {
+        if (response.op != RESPONSE_OF(OP_READ)) {
+            // The reader answered with an error (or something else), pass it on as is.
+            this->send_mfs_message(response, client);
+            return;
+        }
+        char prefix[5];
+        prefix[0] = 1;
+        this->put_u32(prefix + 1, version);
+        response.op = RESPONSE_OF(OP_READ_IF);
+        this->send_mfs_message_prefixed(response, prefix, 5, client);
+    }
+
+#if MFS_ENABLE_READ_MANY
+    // Handles OP_READ_MANY. The data section is a filter, see path_matches(). The request's path is ignored.
+    // Every matching file with a reader is read in this pass and sent as its own frame: the file's path, and the reader's response (op and data) as is, except that OP_READ becomes OP_READ_MANY.
+    // The last frame has no path and [count (4 bytes)] as data, the number of files sent. Only one response is in memory at a time, however many files match.
+    void read_many(client_t client, mfs_message_t request) {
+        if (request.dsize > this->path_bsize) {
+            this->send_mfs_error(request, client, 1);
+            return;
+        }
+        // Readers may use the data buffer, move the filter out of the way first. The path buffer is unused from here on.
+        unsigned int filter_len = request.dsize;
+        this->memcpy(filter_len, request.data, this->path_buffer, 0);
+        char* filter = this->path_buffer;
+
+        unsigned int count = 0;
+        for (unsigned int i = 0; i < this->files_bsize; i++) {
+            mfs_file_t* file = &this->files[i];
+            if (file->path_len == 0 || !this->has_reader(i)) continue;
+            if (!this->path_matches(filter, filter_len, file->path, file->path_len)) continue;
+            // path_size is the size of the application's buffer, only the string and its terminator go on the wire.
+            mfs_message_t file_request = {.psize = file->path_len + 1, .dsize = 0, .op = OP_READ, .path = file->path, .data = this->data_buffer};
+            mfs_message_t response = this->shared_read(i, client, file_request);
+            if (response.op == RESPONSE_OF(OP_READ)) response.op = RESPONSE_OF(OP_READ_MANY);
+            response.path = file->path;
+            response.psize = file->path_len + 1;
+            if (this->send_mfs_message(response, client) != 0) return; // Dropped.
+            count++;
+        }
+
+        if (!this->response_fits(request, client, 4)) return;
+        mfs_message_t done;
+        done.op = RESPONSE_OF(OP_READ_MANY);
+        done.psize = 0;
+        done.path = this->path_buffer;
+        done.dsize = 4;
+        done.data = this->data_buffer;
+        this->put_u32(this->data_buffer, count);
+        this->send_mfs_message(done, client);
+    }
+#endif
+
+    // Calls the reader of the file at index, unless an identical read (same file, same version, same request data) was already answered this pass.
+    // In that case the earlier response is replayed, so a file read by every client at once costs one reader call per pass. Check has_reader() first.
+    // Only plain reader_f files are shared, context-aware readers get the client and might answer each one differently.
+    // Each read is remembered in the coalesce buffer as [file index + 1 (4 bytes)][version (4 bytes)][request size (4 bytes)][response op (1 byte)][response psize (4 bytes)][response dsize (4 bytes)][request data][response path][response data].
+    // The response is copied, the reader's own buffers (or ours) are only good until the next call. Reads that don't fit anymore just aren't shared.
+    mfs_message_t shared_read(unsigned int index, client_t client, mfs_message_t request) {
+#if MFS_ENABLE_COALESCE
+        mfs_file_t* file = &this->files[index];
+        if (this->coalesce_buffer == 0 || file->reader_ctx_f != 0) return this->call_reader(index, client, request);
+
+        mfs_message_t response;
+        for (unsigned int at = 0; at < this->coalesce_used;) {
+            char* entry = this->coalesce_buffer + at;
+            unsigned int request_size = this->get_uint(entry + 8, 4);
+            response.op = entry[12];
+            response.psize = this->get_uint(entry + 13, 4);
+            response.dsize = this->get_uint(entry + 17, 4);
+            if (this->get_uint(entry, 4) == index + 1 && this->get_uint(entry + 4, 4) == file->version
+                && this->memcmp(entry + 21, request.data, request_size, request.dsize) == 0) {
+                response.path = entry + 21 + request_size;
+                response.data = response.path + response.psize;
+                return response;
+            }
+            at += 21 + request_size + response.psize + response.dsize;
+        }
+
+        response = this->call_reader(index, client, request);
+        unsigned long long needed = 21ULL + request.dsize + response.psize + response.dsize;
+        if (needed > this->coalesce_bsize - this->coalesce_used) return response;
+        char* entry = this->coalesce_buffer + this->coalesce_used;
+        this->put_u32(entry, index + 1);
+        this->put_u32(entry + 4, file->version);
+        this->put_u32(entry + 8, request.dsize);
+        entry[12] = response.op;
+        this->put_u32(entry + 13, response.psize);
+        this->put_u32(entry + 17, response.dsize);
+        this->memcpy(request.dsize, request.data, entry + 21, 0);
+        this->memcpy(response.psize, response.path, entry + 21 + request.dsize, 0);
+        this->memcpy(response.dsize, response.data, entry + 21 + request.dsize + response.psize, 0);
+        this->coalesce_used += needed;
+        return response;
+#else
+        return this->call_reader(index, client, request);
+#endif
+    }
+
+    // Sends one page of the file list to the client.
+    // The request's data section is [cursor (4 bytes)][max count (2 bytes)][filter], see path_matches() for the filter syntax.
+    // The response's data section is [next cursor (4 bytes)][NULL-terminated paths]. A next cursor of 0 means the listing is complete.
+    // With with_stat set (OP_LS_STAT), every path is followed by its stat record, which saves clients a probe per file.
+    // The cursor is a position in the file table, so nothing is built up front; we just scan from the cursor until the page (or the data buffer) is full.
+    void list_files_page(client_t client, mfs_message_t request, int with_stat) {
+        if (request.dsize < 6) {
+            this->send_mfs_error(request, client, 3006);
+            return;
+        }
+        unsigned int cursor = this->get_uint(request.data, 4);
+        unsigned int max_count = this->get_uint(request.data + 4, 2);
+        unsigned int filter_len = request.dsize - 6;
+        if (!this->response_fits(request, client, 4)) return;
+        if (filter_len > this->path_bsize) {
+            this->send_mfs_error(request, client, 1);
+            return;
+        }
+        // The response is built in the data buffer, move the filter out of the way first. The path buffer is unused by OP_LS.
+        this->memcpy(filter_len, request.data + 6, this->path_buffer, 0);
+        char* filter = this->path_buffer;
+
+        unsigned int data_processed = 4;
+        unsigned int count = 0;
+        unsigned int next_cursor = 0;
+        unsigned int record_size = with_stat ? MFS_STAT_SIZE : 0;
+        for (unsigned int i = cursor; i < this->files_bsize; i++) {
+            unsigned int str_len = this->files[i].path_len;
+            if (str_len == 0) continue;
+            if (!this->path_matches(filter, filter_len, this->files[i].path, str_len)) continue;
+            if ((max_count != 0 && count == max_count) || data_processed + str_len + 1 + record_size > this->data_bsize) {
+                // Page is full, continue from here next time.
+                next_cursor = i;
+                break;
+            }
+            this->memcpy(str_len, this->files[i].path, this->data_buffer, data_processed);
+            data_processed += str_len;
+            this->data_buffer[data_processed] = '\0';
+            data_processed++;
+            if (with_stat) {
+                this->fill_stat(this->data_buffer + data_processed, i);
+                data_processed += MFS_STAT_SIZE;
+            }
+            count++;
+        }
+        if (next_cursor != 0 && count == 0) {
+            // A single path doesn't fit into the data buffer, we would hand out the same cursor forever.
+            this->send_mfs_error(request, client, 1);
+            return;
+        }
+        this->put_u32(this->data_buffer, next_cursor);
+
+        mfs_message_t msg;
+        msg.dsize = data_processed;
+        msg.psize = 0;
+        msg.op = with_stat ? RESPONSE_OF(OP_LS_STAT) : RESPONSE_OF(OP_LS);
+        msg.data = this->data_buffer;
+        msg.path = this->path_buffer;
+        this->send_mfs_message(msg, client);
+    }
+
+#if MFS_ENABLE_LS
+    // Records a registry change in the journal. Entries are [generation (4 bytes)][MFS_CHANGE_* (1 byte)][path lenght (2 bytes)][path], oldest first.
+    // When the journal is full, the oldest entries make room and the floor moves up past them.
+    void journal_append(unsigned char kind, char* path, unsigned int len) {
+        this->generation++;
+        unsigned int entry_size = 7 + len;
+        if (this->journal_buffer == 0 || entry_size > this->journal_bsize) {
+            // Can't keep it, so nothing older than this is any good either.
+            this->journal_used = 0;
+            this->journal_floor = this->generation;
+            return;
+        }
+        unsigned int dropped = 0;
+        while (this->journal_used - dropped + entry_size > this->journal_bsize) {
+            this->journal_floor = this->get_uint(this->journal_buffer + dropped, 4);
+            dropped += 7 + this->get_uint(this->journal_buffer + dropped + 5, 2);
+        }
+        if (dropped != 0) {
+            this->journal_used -= dropped;
+            this->memcpy(this->journal_used, this->journal_buffer + dropped, this->journal_buffer, 0);
+        }
+        char* entry = this->journal_buffer + this->journal_used;
+        this->put_u32(entry, this->generation);
+        entry[4] = kind;
+        entry[5] = len & 0xFF;
+        entry[6] = (len >> 8) & 0xFF;
+        this->memcpy(len, path, entry, 7);
+        this->journal_used += entry_size;
+    }
+
+    // Handles OP_LS_CHANGES. The data section is [generation (4 bytes)], the generation of the list the client has (0 if it has none.)
+    // Answers with the changes since then, see MFS_CHANGES_DELTA. A client that is up to date gets just the header back.
+    void list_changes(client_t client, mfs_message_t request) {
+        if (request.dsize < 4) {
+            this->send_mfs_error(request, client, 3006);
+            return;
+        }
+        if (!this->response_fits(request, client, 5)) return;
+        unsigned int since = this->get_uint(request.data, 4);
+        unsigned int data_processed = 5;
+        this->put_u32(this->data_buffer, this->generation);
+        this->data_buffer[4] = MFS_CHANGES_DELTA;
+
+        if (since >= this->journal_floor && since <= this->generation) {
+            for (unsigned int at = 0; at < this->journal_used;) {
+                char* entry = this->journal_buffer + at;
+                unsigned int len = this->get_uint(entry + 5, 2);
+                at += 7 + len;
+                if (this->get_uint(entry, 4) <= since) continue;
+                if (data_processed + len + 2 > this->data_bsize) {
+                    data_processed = 0;
+                    break;
+                }
+                this->data_buffer[data_processed++] = entry[4];
+                this->memcpy(len, entry + 7, this->data_buffer, data_processed);
+                data_processed += len;
+                this->data_buffer[data_processed++] = '\0';
+            }
+        } else {
+            // Aged out (or from some other server instance), start over with the whole list.
+            this->data_buffer[4] = MFS_CHANGES_FULL;
+            for (unsigned int i = 0; i < this->files_bsize; i++) {
+                unsigned int len = this->files[i].path_len;
+                if (len == 0) continue;
+                if (data_processed + len + 2 > this->data_bsize) {
+                    data_processed = 0;
+                    break;
+                }
+                this->data_buffer[data_processed++] = MFS_CHANGE_ADDED;
+                this->memcpy(len, this->files[i].path, this->data_buffer, data_processed);
+                data_processed += len;
+                this->data_buffer[data_processed++] = '\0';
+            }
+        }
+        if (data_processed == 0) {
+            // Didn't fit.
+            this->data_buffer[4] = MFS_CHANGES_RELIST;
+            data_processed = 5;
+        }
+
+        mfs_message_t msg;
+        msg.dsize = data_processed;
+        msg.psize = 0;
+        msg.op = RESPONSE_OF(OP_LS_CHANGES);
+        msg.data = this->data_buffer;
+        msg.path = this->path_buffer;
+        this->send_mfs_message(msg, client);
+    }
+#endif
+
     // Sends the list of files to the client.
     // Silently drops clients if sending the paths fail for some reason, as it breaks the protocol's synchronisation.
     void list_files(client_t client) {
@@ -325,14 +1484,16 @@ class mfs_server {
         // First, we will need a total size lenght of the total file paths.
         unsigned int total_size = 0;
         for (unsigned int i = 0; i < this->files_bsize; i++) {
-            total_size += this->strlen(this->files[i].path, this->files[i].path_size); // No string means 0 output, so this addition is safe.
+            unsigned int str_len = this->files[i].path_len;
+            if (str_len == 0) continue; // Empty slots aren't listed, so they don't get a terminator either.
+            total_size += str_len;
             total_size += 1; // nterminator
         }
         if (total_size <= this->data_bsize) {
             // So, the data can fit into the data buffer, we use this to directly call send_mfs_message do the job for us.
             unsigned int data_processed = 0;
             for (unsigned int i = 0; i < this->files_bsize; i++) {
-                unsigned int str_len = this->strlen(this->files[i].path, this->files[i].path_size);
+                unsigned int str_len = this->files[i].path_len;
                 if (str_len == 0) continue;
                 // First copy over the path
                 this->memcpy(str_len, this->files[i].path, this->data_buffer, data_processed);
@@ -368,10 +1529,15 @@ class mfs_server {
             this->drop_client(client);
             return;
         }
+#if MFS_ENABLE_CRC
+        int uses_crc = this->client_uses_crc(client);
+        unsigned int crc = 0;
+        if (uses_crc) crc = this->crc_f(0, buffer, 9);
+#endif
         // Now we loop over the files writing the paths and newlines.
         char terminator = '\0';
         for (unsigned int i = 0; i < this->files_bsize; i++) {
-            unsigned int str_len = this->strlen(this->files[i].path, this->files[i].path_size);
+            unsigned int str_len = this->files[i].path_len;
             if (str_len == 0) continue;
             if (this->client_writer(client, this->files[i].path, str_len) != str_len) {
                 // Failure, so drop client.
@@ -383,52 +1549,719 @@ class mfs_server {
                 this->drop_client(client);
                 return;
             }
+#if MFS_ENABLE_CRC
+            if (uses_crc) {
+                crc = this->crc_f(crc, this->files[i].path, str_len);
+                crc = this->crc_f(crc, &terminator, 1);
+            }
+#endif
         }
+#if MFS_ENABLE_CRC
+        if (uses_crc) this->send_crc(client, crc);
+#endif
     }
 
-public:
-    unsigned int timer_ms = 20000; // Client timeout.
-    unsigned int hard_limit = 10000; // This is a hard limit that defines the maximum amount of bytes before a client is dropped. It protects against DoS attacks.
+    // Returns 1 if op addresses a file through its path, 0 if the path is ignored.
+    int op_takes_path(unsigned char op) {
+        if (op == OP_READ || op == OP_WRITE || op == OP_CHUNK || op == OP_STAT || op == OP_READ_IF || op == OP_SUBSCRIBE) return 1;
+        return 0;
+    }
 
-    // Finally, the quintessential loop that serves the clients of MFS.
-    void serve_clients() {
-        mfs_message_t noop_response;
-        noop_response.data = 0;
-        noop_response.path = 0;
-        noop_response.dsize = 0;
-        noop_response.psize = 0;
-        noop_response.op = RESPONSE_OF(OP_NOOP);
-        for (unsigned int i = 0; i < this->clients_len; i++) {
-            if (this->clients[i].client == 0) continue;
+#if MFS_ENABLE_SESSIONS
+    // Next session token. Tokens tell sessions apart, they are NOT credentials: anybody who can reach the server can read its files anyway.
+    unsigned int next_token() {
+        unsigned int x;
+        do {
+            x = this->token_state;
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            this->token_state = x;
+        } while (x == 0);
+        return x;
+    }
+
+    // Handles MFS_SETUP_SESSION. Restores the session with token (if it is dormant and still around) into the client, or opens a new one.
+    // crc is handle_setup()'s pending CRC setting. Returns the client's token, 0 if the session table is full (or there is none.)
+    unsigned int resume_session(client_handlers_t* client, unsigned int token, unsigned char* crc) {
+        if (this->sessions == 0) return 0;
+        if (client->session != 0) return this->sessions[client->session - 1].token; // Already has one.
+        mfs_session_t* session = 0;
+        for (unsigned int i = 0; i < this->sessions_len && token != 0; i++) {
+            mfs_session_t* s = &this->sessions[i];
+            if (s->token == token && s->owner == 0 && s->expires > this->now_ms) session = s;
+        }
+        if (session != 0) {
+            client->window = session->window > this->max_window ? this->max_window : session->window;
+            client->credit = client->window;
+            *crc = session->crc;
+            client->sub_file = session->sub_file;
+            client->sub_version = session->sub_version;
+            client->sub_mode = session->sub_mode;
+            client->sub_base = 0;
+            client->sub_deltas = 0;
+            // sub_file is still the same file, forget_file() clears it when a file goes. Anything that changed meanwhile gets pushed on the next pass.
+        } else {
+            for (unsigned int i = 0; i < this->sessions_len && session == 0; i++) {
+                mfs_session_t* s = &this->sessions[i];
+                if (s->token == 0 || (s->owner == 0 && s->expires <= this->now_ms)) session = s;
+            }
+            if (session == 0) return 0;
+        }
+        session->token = this->next_token(); // A token is only good once.
+        session->owner = client->client;
+        client->session = (session - this->sessions) + 1;
+        return session->token;
+    }
+#endif
+
+    // Handles OP_SETUP. Applies whatever keys we understand, ignores the rest and answers with the values we actually agreed on.
+    // The CRC setting applies from the frame after the response on, so the client can read the response either way.
+    void handle_setup(unsigned int client_index, mfs_message_t request) {
+        client_handlers_t* client = &this->clients[client_index];
+        // The response is 15 bytes (21 with a session token), checked up front so a resumed session isn't claimed by a client that never gets its token.
+        // This also keeps the announced chunk size (data_bsize - 4) from underflowing. Only a client asking for a session needs the 21.
+        int session_asked = 0;
+#if MFS_ENABLE_SESSIONS
+        for (unsigned int i = 0; i + 2 <= request.dsize;) {
+            unsigned char len = request.data[i + 1];
+            if (i + 2 + len > request.dsize) break; // Truncated entry, ignored below too.
+            if (request.data[i] == MFS_SETUP_SESSION) session_asked = 1;
+            i += 2 + len;
+        }
+#endif
+        if (!this->response_fits(request, client->client, session_asked ? 21 : 15)) return;
+        unsigned char crc = client->crc;
+        unsigned int token = 0;
+        for (unsigned int i = 0; i + 2 <= request.dsize;) {
+            unsigned char key = request.data[i];
+            unsigned char len = request.data[i + 1];
+            i += 2;
+            if (i + len > request.dsize) break; // Truncated entry, ignore it.
+
+            if (key == MFS_SETUP_WINDOW) {
+                unsigned int window = this->get_uint(request.data + i, len);
+                if (window > this->max_window) window = this->max_window;
+                client->window = window;
+                client->credit = window;
+            }
+#if MFS_ENABLE_CRC
+            if (key == MFS_SETUP_CRC) crc = this->get_uint(request.data + i, len) != 0;
+#endif
+#if MFS_ENABLE_SESSIONS
+            if (key == MFS_SETUP_SESSION) token = this->resume_session(client, this->get_uint(request.data + i, len), &crc);
+#endif
+            i += len;
+        }
+
+        // Answer with the negotiated values, there's room for them (checked above.)
+        unsigned int chunk_size = this->data_bsize - 4;
+        this->data_buffer[0] = MFS_SETUP_WINDOW;
+        this->data_buffer[1] = 4;
+        this->put_u32(this->data_buffer + 2, client->window);
+        this->data_buffer[6] = MFS_SETUP_CHUNK_SIZE;
+        this->data_buffer[7] = 4;
+        this->put_u32(this->data_buffer + 8, chunk_size);
+        this->data_buffer[12] = MFS_SETUP_CRC;
+        this->data_buffer[13] = 1;
+        this->data_buffer[14] = crc;
+        // The token only goes to clients that asked, older clients get the exact same response as before.
+        if (session_asked) {
+            this->data_buffer[15] = MFS_SETUP_SESSION;
+            this->data_buffer[16] = 4;
+            this->put_u32(this->data_buffer + 17, token);
+        }
+
+        mfs_message_t msg;
+        msg.op = RESPONSE_OF(OP_SETUP);
+        msg.psize = 0;
+        msg.dsize = session_asked ? 21 : 15;
+        msg.path = this->path_buffer;
+        msg.data = this->data_buffer;
+        this->send_mfs_message(msg, client->client);
+        client->crc = crc;
+    }
+
+    // Handles OP_CREDIT. The data section is the number of chunks the client is ready to receive (16 bit),
+    // optionally followed by the offset up to which the client has safely stored the stream (32 bit). That offset is where a resumed transfer restarts.
+    // No response is sent, a credit message per consumed chunk would otherwise double the traffic.
+    void handle_credit(unsigned int client_index, mfs_message_t request) {
+        client_handlers_t* client = &this->clients[client_index];
+        if (request.dsize >= 6 && client->stream_transfer != 0) {
+            mfs_transfer_t* t = &this->transfers[client->stream_transfer - 1];
+            unsigned long long acked = this->get_uint(request.data + 2, 4);
+            if (acked > client->stream_offset) acked = client->stream_offset; // Can't acknowledge what we never sent.
+            if (acked > t->committed) t->committed = acked;
+        }
+        if (client->window == 0) return; // No flow control, credit means nothing.
+        unsigned int granted = this->get_uint(request.data, request.dsize < 2 ? request.dsize : 2);
+        client->credit += granted;
+        if (client->credit > client->window) client->credit = client->window; // Never allow more than a window ahead.
+    }
+
+    // Sends the next chunk of the client's stream, if it has one and has the credit for it.
+    // Only one chunk per pass, so a large transfer can't starve the other clients.
+    // A chunk is an OP_CHUNK response with [offset (4 bytes)][payload] as data. An empty payload marks the end of the stream.
+    void pump_stream(unsigned int client_index) {
+        client_handlers_t* client = &this->clients[client_index];
+        if (client->stream_file == 0) return;
 
-            if (this->clients[i].timer_end <= this->millis()) {
+        mfs_message_t msg;
+        msg.psize = 0;
+        msg.path = this->path_buffer;
+        if (client->stream_file == MFS_STREAM_LOST) {
+            // Unregistered under us, see forget_file().
+            this->end_stream(client);
+            this->send_mfs_error(msg, client->client, 1000);
+            return;
+        }
+        if (this->split_mode()) {
+            // Carried over by import_state(), but the chunk reader can't run on this core. Split mode doesn't stream.
+            this->end_stream(client);
+            this->send_mfs_error(msg, client->client, 3003);
+            return;
+        }
+        if (client->window != 0 && client->credit == 0) return; // Waiting for the client to catch up.
+
+        mfs_file_t* file = &this->files[client->stream_file - 1];
+        long long produced = -1;
+        if (file->chunk_reader_f != 0) produced = file->chunk_reader_f(client->stream_offset, this->data_buffer + 4, this->data_bsize - 4);
+
+        if (produced < 0) {
+            // Handler failed, abort the transfer.
+            if (client->stream_transfer != 0) this->transfers[client->stream_transfer - 1].id = 0;
+            client->stream_transfer = 0;
+            this->end_stream(client);
+            this->send_mfs_error(msg, client->client, 1001);
+            return;
+        }
+
+        MFS_ASSERT((unsigned long long)produced <= this->data_bsize - 4);
+        this->put_u32(this->data_buffer, (unsigned int)client->stream_offset);
+        msg.op = RESPONSE_OF(OP_CHUNK);
+        msg.dsize = 4 + (unsigned int)produced;
+        msg.data = this->data_buffer;
+
+        if (produced == 0) {
+            // End of the file.
+            this->end_stream(client);
+        } else {
+            client->stream_offset += produced;
+            if (client->window != 0) client->credit--;
+        }
+        if (this->send_mfs_message(msg, client->client) == 0) client->timer_end = this->now_ms + this->timer_ms; // A client that keeps consuming a stream isn't idle.
+    }
+
+    // Starts streaming file_index to the client. Answers the OP_READ with the transfer id (32 bit, 0 if the transfer isn't resumable), the chunks follow.
+    void start_stream(unsigned int client_index, unsigned int file_index, mfs_message_t request) {
+        client_handlers_t* client = &this->clients[client_index];
+        if (client->stream_file != 0) {
+            // One stream per client at a time.
+            this->send_mfs_error(request, client->client, 3004);
+            return;
+        }
+        // Chunks are [offset (4 bytes)][payload], there has to be room for at least a byte of payload.
+        if (!this->response_fits(request, client->client, 5)) return;
+        client->stream_file = file_index + 1;
+        client->stream_offset = 0;
+
+        mfs_transfer_t* t = this->open_transfer(file_index, OP_READ, client->client);
+        unsigned int id = 0;
+        if (t != 0) {
+            client->stream_transfer = (t - this->transfers) + 1;
+            id = t->id;
+        }
+
+        request.op = RESPONSE_OF(OP_READ);
+        request.dsize = 4;
+        request.data = this->data_buffer;
+        this->put_u32(this->data_buffer, id);
+        this->send_mfs_message(request, client->client);
+    }
+
+    // Handles OP_RESUME. The data section is the transfer id (32 bit.)
+    // Answers with [id (4 bytes)][committed offset (4 bytes)]. Reads continue streaming from the committed offset, writes expect the next OP_CHUNK at it.
+    void handle_resume(unsigned int client_index, mfs_message_t request) {
+        client_handlers_t* client = &this->clients[client_index];
+        mfs_transfer_t* t = 0;
+        if (!this->response_fits(request, client->client, 8)) return;
+        if (request.dsize >= 4) t = this->find_transfer(this->get_uint(request.data, 4));
+        if (t == 0 || (t->owner != 0 && t->owner != client->client) || this->is_file_empty(t->file - 1)) {
+            // Unknown, expired, or somebody else is already using it.
+            this->send_mfs_error(request, client->client, 3005);
+            return;
+        }
+        if (t->direction == OP_READ) {
+            if (client->stream_file != 0) {
+                this->send_mfs_error(request, client->client, 3004);
+                return;
+            }
+            client->stream_file = t->file;
+            client->stream_offset = t->committed;
+            client->stream_transfer = (t - this->transfers) + 1;
+            client->credit = client->window;
+        }
+        t->owner = client->client;
+
+        request.op = RESPONSE_OF(OP_RESUME);
+        request.dsize = 8;
+        request.data = this->data_buffer;
+        this->put_u32(this->data_buffer, t->id);
+        this->put_u32(this->data_buffer + 4, (unsigned int)t->committed);
+        this->send_mfs_message(request, client->client);
+    }
+
+    // Handles an OP_CHUNK upload. The data section is [transfer id (4 bytes)][offset (4 bytes)][payload], an id of 0 opens a new transfer.
+    // Chunks have to arrive in order, anything below the committed offset was already written and is skipped (a client re-sending after a reconnect.)
+    // An empty payload finishes the upload. Answers with [id (4 bytes)][committed offset (4 bytes)].
+    void handle_write_chunk(unsigned int client_index, unsigned int file_index, mfs_message_t request) {
+        client_handlers_t* client = &this->clients[client_index];
+        mfs_file_t* file = &this->files[file_index];
+        if (file->chunk_writer_f == 0) {
+            this->send_mfs_error(request, client->client, 1002);
+            return;
+        }
+        if (request.dsize < 8) {
+            this->send_mfs_error(request, client->client, 3006);
+            return;
+        }
+        if (!this->response_fits(request, client->client, 8)) return;
+        unsigned int id = this->get_uint(request.data, 4);
+        unsigned long long offset = this->get_uint(request.data + 4, 4);
+        char* payload = request.data + 8;
+        unsigned int payload_size = request.dsize - 8;
+
+        mfs_transfer_t* t;
+        if (id == 0) t = this->open_transfer(file_index, OP_WRITE, client->client);
+        else t = this->find_transfer(id);
+        if (t == 0 || t->file != file_index + 1 || t->direction != OP_WRITE || (t->owner != 0 && t->owner != client->client) || offset > t->committed) {
+            // No free slot, unknown transfer, or a gap in the upload.
+            this->send_mfs_error(request, client->client, 3005);
+            return;
+        }
+        t->owner = client->client;
+
+        unsigned int skip = t->committed - offset;
+        if (skip > payload_size) skip = payload_size;
+        if (payload_size - skip > 0) {
+            long long written = file->chunk_writer_f(t->committed, payload + skip, payload_size - skip);
+            if (written < 0) {
+                t->id = 0;
+                this->send_mfs_error(request, client->client, 1001);
+                return;
+            }
+            t->committed += written;
+        }
+        id = t->id;
+        if (payload_size == 0) {
+            // Upload finished.
+            if (file->chunk_writer_f(t->committed, payload, 0) < 0) {
+                t->id = 0;
+                this->send_mfs_error(request, client->client, 1001);
+                return;
+            }
+            t->id = 0;
+            this->touch_file(file_index);
+        }
+
+        request.op = RESPONSE_OF(OP_CHUNK);
+        request.dsize = 8;
+        // request.data points into data_buffer, the payload is consumed by now so overwriting it is fine.
+        this->put_u32(this->data_buffer, id);
+        this->put_u32(this->data_buffer + 4, (unsigned int)t->committed);
+        request.data = this->data_buffer;
+        this->send_mfs_message(request, client->client);
+    }
+
+#if MFS_ENABLE_SUBSCRIBE
+    // Encodes data as a delta against base (see MFS_UPDATE_DELTA) into out.
+    // Returns the lenght of the delta, or -1 if it would not be smaller than data itself (or doesn't fit out.)
+    // Unchanged runs shorter than a patch header are sent along with the patch instead of splitting it.
+    long long encode_delta(char* base, unsigned int base_len, char* data, unsigned int len, char* out, unsigned int out_size) {
+        unsigned int limit = len < out_size ? len : out_size;
+        if (limit < 4) return -1;
+        this->put_u32(out, len);
+        unsigned int used = 4;
+        unsigned int last_end = 0;
+        unsigned int i = 0;
+        while (i < len) {
+            if (i < base_len && base[i] == data[i]) {
+                i++;
+                continue;
+            }
+            unsigned int end = i;
+            while (end < len) {
+                unsigned int run = 0;
+                while (end + run < len && end + run < base_len && base[end + run] == data[end + run] && run < 8) run++;
+                if (run == 8) break;
+                end += run != 0 ? run : 1;
+            }
+            char header[20];
+            unsigned int header_len = this->put_varint(header, i - last_end);
+            header_len += this->put_varint(header + header_len, end - i);
+            if ((unsigned long long)used + header_len + (end - i) >= limit) return -1;
+            this->memcpy(header_len, header, out, used);
+            used += header_len;
+            this->memcpy(end - i, data + i, out, used);
+            used += end - i;
+            last_end = end;
+            i = end;
+        }
+        return used;
+    }
+
+    // Pushes the subscribed file to the client if it changed since the last update (or if force is set.)
+    // Deltas are built in the data buffer, so readers answering out of it (in the request's data) always get full updates.
+    void push_update(unsigned int client_index, int force) {
+        client_handlers_t* client = &this->clients[client_index];
+        if (client->sub_file == 0) return;
+        unsigned int index = client->sub_file - 1;
+        mfs_file_t* file = &this->files[index];
+        if (this->is_file_empty(index) || !this->has_reader(index) || this->split_mode()) {
+            // Unregistered under us. (Or carried over by import_state() or a resumed session into split mode, which has no subscriptions.)
+            client->sub_file = 0;
+            client->sub_base = 0;
+            return;
+        }
+        if (!force && file->version == client->sub_version) return;
+
+        mfs_message_t request = {.psize = file->path_len + 1, .dsize = 0, .op = OP_READ, .path = file->path, .data = this->data_buffer};
+        mfs_message_t response = this->shared_read(index, client->client, request);
+        if (response.op != RESPONSE_OF(OP_READ)) {
+            // Nothing to push for this version.
+            client->sub_version = file->version;
+            return;
+        }
+
+        char prefix[MFS_UPDATE_HEADER];
+        prefix[0] = MFS_UPDATE_FULL;
+        this->put_u32(prefix + 1, client->sub_version);
+        this->put_u32(prefix + 5, file->version);
+        mfs_message_t update = {.psize = file->path_len + 1, .dsize = response.dsize, .op = RESPONSE_OF(OP_SUBSCRIBE), .path = file->path, .data = response.data};
+
+        unsigned int share = this->clients_len != 0 ? this->delta_bsize / this->clients_len : 0;
+        char* base = this->delta_buffer + share * client_index;
+        long long delta_len = -1;
+        int in_data_buffer = response.data >= this->data_buffer && response.data < this->data_buffer + this->data_bsize;
+        if (client->sub_mode == MFS_SUBSCRIBE_DELTA && !force && client->sub_base != 0 && client->sub_deltas < this->delta_resync && !in_data_buffer) {
+            delta_len = this->encode_delta(base, client->sub_base - 1, response.data, response.dsize, this->data_buffer, this->data_bsize);
+        }
+        if (delta_len >= 0) {
+            prefix[0] = MFS_UPDATE_DELTA;
+            update.data = this->data_buffer;
+            update.dsize = delta_len;
+            client->sub_deltas++;
+        } else {
+            client->sub_deltas = 0;
+        }
+        if (this->send_mfs_message_prefixed(update, prefix, MFS_UPDATE_HEADER, client->client) != 0) return; // Dropped.
+
+        // The payload becomes the base for the next delta, if it fits the client's share.
+        client->sub_base = 0;
+        if (client->sub_mode == MFS_SUBSCRIBE_DELTA && response.dsize < share) {
+            this->memcpy(response.dsize, response.data, base, 0);
+            client->sub_base = response.dsize + 1;
+        }
+        client->sub_version = file->version;
+    }
+
+    // Handles OP_SUBSCRIBE. The data section is [mode (1 byte)], a client has at most one subscription and subscribing again replaces it.
+    // Answers with [mode (1 byte)], followed by a full update of the file right away.
+    void handle_subscribe(unsigned int client_index, unsigned int file_index, mfs_message_t request) {
+        client_handlers_t* client = &this->clients[client_index];
+        unsigned char mode = request.dsize >= 1 ? request.data[0] : MFS_SUBSCRIBE_FULL;
+        if (!this->response_fits(request, client->client, 1)) return;
+        if (mode > MFS_SUBSCRIBE_DELTA) {
+            this->send_mfs_error(request, client->client, 3006);
+            return;
+        }
+        if (mode != MFS_SUBSCRIBE_OFF && !this->has_reader(file_index)) {
+            this->send_mfs_error(request, client->client, 1002);
+            return;
+        }
+        client->sub_file = mode != MFS_SUBSCRIBE_OFF ? file_index + 1 : 0;
+        client->sub_mode = mode;
+        client->sub_base = 0;
+        client->sub_deltas = 0;
+
+        request.op = RESPONSE_OF(OP_SUBSCRIBE);
+        request.dsize = 1;
+        request.data = this->data_buffer;
+        this->data_buffer[0] = mode;
+        if (this->send_mfs_message(request, client->client) != 0) return;
+        this->push_update(client_index, 1);
+    }
+#endif
+
+#if MFS_ENABLE_SPLIT
+    // Returns a free job, or NULL if they are all in flight. I/O core only.
+    mfs_job_t* free_job() {
+        for (unsigned int i = 0; i < this->jobs_len; i++) {
+            if (!this->jobs[i].in_use) return &this->jobs[i];
+        }
+        return 0;
+    }
+
+    // Hands the request to the handler core. The response goes out from complete_jobs() once it is back.
+    // The client gets no further requests read until then, so its responses stay in order.
+    void queue_job(unsigned int client_index, unsigned int file_index, mfs_message_t request) {
+        client_handlers_t* client = &this->clients[client_index];
+        mfs_file_t* file = &this->files[file_index];
+        mfs_job_t* job = this->free_job();
+        if (job == 0 || (unsigned long long)request.psize + request.dsize > job->bsize) {
+            // free_job() was checked before reading the request, so this is a request too large for the job buffer.
+            this->send_mfs_error(request, client->client, 1);
+            return;
+        }
+        job->client_index = client_index;
+        job->file_index = file_index;
+        job->client = client->client;
+        job->version = file->version;
+        job->context = file->context;
+        job->writer_f = file->writer_f;
+        job->reader_f = file->reader_f;
+        job->writer_ctx_f = file->writer_ctx_f;
+        job->reader_ctx_f = file->reader_ctx_f;
+        job->request = request;
+        job->request.path = job->buffer;
+        job->request.data = job->buffer + request.psize;
+        this->memcpy(request.psize, request.path, job->buffer, 0);
+        this->memcpy(request.dsize, request.data, job->buffer, request.psize);
+        job->in_use = 1;
+        client->job = (job - this->jobs) + 1;
+        mfs_spsc_push(&this->job_requests, job - this->jobs); // Can't be full, it holds as many entries as there are jobs.
+    }
+
+    // Returns 1 if the file slot job was queued for still has the handlers the job ran, 0 if the file went meanwhile.
+    int job_file_current(mfs_job_t* job) {
+        mfs_file_t* file = &this->files[job->file_index];
+        return file->path_len != 0 && file->context == job->context && file->writer_f == job->writer_f && file->reader_f == job->reader_f
+            && file->writer_ctx_f == job->writer_ctx_f && file->reader_ctx_f == job->reader_ctx_f;
+    }
+
+    // Returns 1 if request would run handlers on the I/O core. Only OP_READ, OP_READ_IF and OP_WRITE go through jobs, see enable_split().
+    int split_refuses(long long file_index, mfs_message_t request) {
+        switch (request.op) {
+            case OP_READ_MANY:
+            case OP_SUBSCRIBE:
+            case OP_CHUNK:
+            case OP_RESUME:
+                return 1;
+            case OP_READ:
+                return !this->has_reader(file_index) && this->files[file_index].chunk_reader_f != 0; // Streamed only.
+        }
+        return 0;
+    }
+
+    // The request job's handler gets. OP_READ_IF's own header isn't for the reader.
+    mfs_message_t job_handler_request(mfs_job_t* job) {
+        mfs_message_t request = job->request;
+        if (request.op == OP_READ_IF) {
+            request.data += 5;
+            request.dsize -= 5;
+        }
+        return request;
+    }
+
+    // Returns 1 if a job still calls into the file at index.
+    int file_has_jobs(unsigned int index) {
+        for (unsigned int i = 0; i < this->jobs_len; i++) {
+            if (this->jobs[i].in_use && this->jobs[i].file_index == index) return 1;
+        }
+        return 0;
+    }
+
+    // Sends the responses of the jobs the handler core finished. I/O core only.
+    // Version bumps and derived caches are done here, the handler core never touches the file table.
+    void complete_jobs() {
+        unsigned int index;
+        while (mfs_spsc_pop(&this->job_responses, &index) == 0) {
+            mfs_job_t* job = &this->jobs[index];
+            client_handlers_t* client = &this->clients[job->client_index];
+            job->in_use = 0;
+            int is_current = this->job_file_current(job);
+            if (is_current && job->request.op == OP_WRITE && job->response.op == RESPONSE_OF(OP_WRITE)) this->touch_file(job->file_index); // Not for a refused write.
+            if (is_current && job->request.op != OP_WRITE && job->response.data != 0) this->cache_read(job->file_index, job->version, this->job_handler_request(job), job->response);
+            if (client->job != index + 1) continue; // Dropped in the meantime, maybe replaced by another client.
+            client->job = 0;
+            if (!is_current) this->send_mfs_error(job->request, client->client, 1000);
+            else if (job->response.data == 0) this->send_mfs_error(job->request, client->client, 1);
+#if MFS_ENABLE_READ_IF
+            else if (job->request.op == OP_READ_IF) this->send_conditional(client->client, job->version, job->response); // Modified as of the version it was queued at.
+#endif
+            else this->send_mfs_message(job->response, client->client);
+        }
+    }
+#endif
+
+#if MFS_ENABLE_HANDOFF
+    // Handoff serialisation helpers. *at ends up past size once something didn't fit (or ran off the end), every later call is then a no-op.
+    void handoff_put(char* buffer, unsigned int size, unsigned int* at, unsigned long long value, unsigned int width) {
+        if (*at > size || width > size - *at) {
+            *at = size + 1;
+            return;
+        }
+        for (unsigned int i = 0; i < width; i++) buffer[(*at)++] = (value >> (8 * i)) & 0xFF;
+    }
+
+    unsigned long long handoff_get(char* buffer, unsigned int size, unsigned int* at, unsigned int width) {
+        if (*at > size || width > size - *at) {
+            *at = size + 1;
+            return 0;
+        }
+        unsigned long long value = 0;
+        for (unsigned int i = 0; i < width; i++) value |= (unsigned long long)(unsigned char)buffer[(*at)++] << (8 * i);
+        return value;
+    }
+
+    // Files are identified by path, the new process may register them in other slots. [lenght (2 bytes)][path], a lenght of 0 for none.
+    // A stream's MFS_STREAM_LOST is written as a lenght of MFS_HANDOFF_LOST without a path.
+    void handoff_put_file(char* buffer, unsigned int size, unsigned int* at, unsigned int file) {
+        if (file == MFS_STREAM_LOST) {
+            this->handoff_put(buffer, size, at, MFS_HANDOFF_LOST, 2);
+            return;
+        }
+        unsigned int len = file != 0 ? this->files[file - 1].path_len : 0;
+        this->handoff_put(buffer, size, at, len, 2);
+        if (len == 0) return;
+        if (*at > size || len > size - *at) {
+            *at = size + 1;
+            return;
+        }
+        this->memcpy(len, this->files[file - 1].path, buffer, *at);
+        *at += len;
+    }
+
+    // Returns the file's index PLUS ONE, 0 for none. A file that isn't registered here (or got lost in the old process) gives missing.
+    unsigned int handoff_get_file(char* buffer, unsigned int size, unsigned int* at, unsigned int missing = 0) {
+        unsigned int len = this->handoff_get(buffer, size, at, 2);
+        if (len == MFS_HANDOFF_LOST) return missing;
+        if (len == 0 || *at > size || len > size - *at) {
+            if (len != 0) *at = size + 1;
+            return 0;
+        }
+        long long index = -1;
+        for (unsigned int i = 0; i < this->files_bsize && index == -1; i++) {
+            if (this->files[i].path_len == len && this->memcmp(this->files[i].path, buffer + *at, len, len) == 0) index = i;
+        }
+        *at += len;
+        return index != -1 ? index + 1 : missing;
+    }
+#endif
+
+public:
+    unsigned int timer_ms = 20000; // Client timeout.
+    unsigned int hard_limit = 10000; // This is a hard limit that defines the maximum amount of bytes before a client is dropped. It protects against DoS attacks.
+    unsigned int transfer_ttl_ms = 120000; // How long a resumable transfer is kept around after its client disconnected.
+    unsigned int session_ttl_ms = 120000; // How long a dormant session is kept around, see enable_sessions().
+    unsigned char strict_paths = 0; // Reject paths with control characters (bytes below 0x20) in them.
+    unsigned int max_window = 16; // Upper bound on the chunk window a client can negotiate. Bounds how much data can be in flight per client.
+    capture_cb capture = 0; // Optional session capture, see mfs_replay for the other end.
+#if MFS_ENABLE_CRC
+    crc_cb crc_f = mfs_crc32c; // CRC32C implementation for frame trailers, point it at a CRC peripheral if the MCU has one.
+#endif
+#if MFS_ENABLE_LS
+    // Optional. Journal of registry changes, lets OP_LS_CHANGES answer with just what changed. Each change takes 7 bytes plus the path.
+    // Without it (or once a generation has aged out of it) clients are sent the full list instead.
+    char* journal_buffer = 0;
+    unsigned int journal_bsize = 0;
+#endif
+#if MFS_ENABLE_SUBSCRIBE
+    // Optional. Keeps the last payload sent to every MFS_SUBSCRIBE_DELTA subscriber, so changes can be sent as deltas.
+    // It is split evenly between the client slots, subscribers whose payload doesn't fit their share get full updates.
+    char* delta_buffer = 0;
+    unsigned int delta_bsize = 0;
+    unsigned int delta_resync = 16; // A full update every this many deltas, so a client that lost track gets back in sync eventually.
+#endif
+#if MFS_ENABLE_COALESCE
+    // Optional. With a buffer here, identical reads of a file within one pass share a single reader call, see shared_read().
+    // Roughly (21 + request size + response size) bytes per distinct read in a pass.
+    char* coalesce_buffer = 0;
+    unsigned int coalesce_bsize = 0;
+#endif
+
+    // Finally, the quintessential loop that serves the clients of MFS.
+    void serve_clients() {
+        mfs_message_t noop_response;
+        noop_response.data = 0;
+        noop_response.path = 0;
+        noop_response.dsize = 0;
+        noop_response.psize = 0;
+        noop_response.op = RESPONSE_OF(OP_NOOP);
+        // One clock sample for the whole pass.
+        this->refresh_clock();
+#if MFS_ENABLE_EVENTS
+        if (this->event_bits != 0) this->drain_events();
+#endif
+#if MFS_ENABLE_COALESCE
+        // Reads are only shared within a pass.
+        this->coalesce_used = 0;
+#endif
+        for (unsigned int i = 0; i < this->clients_len; i++) {
+            if (this->clients[i].client == 0) continue;
+
+            if (this->clients[i].timer_end <= this->now_ms) {
                 // Client has expired.
                 this->send_mfs_error(noop_response, this->clients[i].client, 3000);
                 this->drop_client(this->clients[i].client);
                 continue;
             }
 
+#if MFS_ENABLE_STREAMING
+            this->pump_stream(i);
+            if (this->clients[i].client == 0) continue; // Dropped while streaming.
+#endif
+
+#if MFS_ENABLE_SUBSCRIBE
+            this->push_update(i, 0);
+            if (this->clients[i].client == 0) continue; // Dropped while pushing.
+#endif
+
+#if MFS_ENABLE_SPLIT
+            // A client waiting for its job doesn't get its next request read yet. Neither does anybody while all jobs are taken, we wouldn't have anywhere to put the request.
+            if (this->jobs != 0 && (this->clients[i].job != 0 || this->free_job() == 0)) continue;
+#endif
+
+#if MFS_ENABLE_EVENTS
+            // Event driven, only clients that were signaled get polled. One that had a request keeps getting polled until it runs dry.
+            if (this->event_bits != 0 && !this->clients[i].ready) continue;
+            this->clients[i].ready = 0;
+#endif
+
             if (client_available(this->clients[i].client) >= 9) {
-                mfs_message_t client_request = this->read_mfs_message(this->clients[i].client);
+#if MFS_ENABLE_EVENTS
+                this->clients[i].ready = 1;
+#endif
+                long long file_index = -2;
+                mfs_message_t client_request = this->read_mfs_message(this->clients[i].client, &file_index);
                 if (client_request.data == 0 && client_request.path == 0 && client_request.dsize == 0 && client_request.psize == 0) {
                     // Reading client's request failed. We are most likely de-synchronised, so we drop it.
                     this->drop_client(this->clients[i].client);
                     continue;
                 }
                 // update client's timeout before i forget to write it
-                this->clients[i].timer_end = this->millis() + this->timer_ms;
+                this->clients[i].timer_end = this->now_ms + this->timer_ms;
+                // Rejected by read_mfs_message (and the error is already sent), but still in sync.
+                if (client_request.op == RESPONSE_OF(OP_ERROR)) continue;
 
                 // Read MFS message does the hard-part for us, now we just check if the path exists and redirect to its file and function.
-                long long file_index = this->get_file_index(client_request.path, strlen(client_request.path, client_request.psize));
-                if (file_index == -1) {
-                    // File does not exist.
-                    if (client_request.op == OP_LS | client_request.op == OP_NOOP) goto discard_file_nonexistent;
-                    this->send_mfs_error(client_request, this->clients[i].client, 1000);
-                    continue;
+                // Ops that don't address a file skip the lookup entirely. (And writes got theirs in read_mfs_message already.)
+                if (this->op_takes_path(client_request.op)) {
+                    if (file_index == -2) file_index = this->get_file_index(client_request.path, client_request.psize);
+                    if (file_index == -1) {
+                        // File does not exist.
+                        this->send_mfs_error(client_request, this->clients[i].client, 1000);
+                        continue;
+                    }
                 }
-                discard_file_nonexistent:
-
 
+#if MFS_ENABLE_SPLIT
+                if (this->jobs != 0 && this->split_refuses(file_index, client_request)) {
+                    // Would run handlers on this core, see enable_split().
+                    this->send_mfs_error(client_request, this->clients[i].client, 3003);
+                    continue;
+                }
+#endif
 
                 // now, we parse the opcode.
                 switch (client_request.op) {
@@ -437,22 +2270,116 @@ public:
                         this->send_mfs_message(noop_response, this->clients[i].client);
                         break;
 
+#if MFS_ENABLE_LS
                     case OP_LS:
-                        this->list_files(this->clients[i].client);
+                        // An empty data section asks for the whole list (the original OP_LS), anything else is a paginated request.
+                        if (client_request.dsize == 0) this->list_files(this->clients[i].client);
+                        else this->list_files_page(this->clients[i].client, client_request, 0);
+                        break;
+#endif
+
+#if MFS_ENABLE_LS
+                    case OP_LS_CHANGES:
+                        this->list_changes(this->clients[i].client, client_request);
+                        break;
+#endif
+
+#if MFS_ENABLE_LS && MFS_ENABLE_STAT
+                    case OP_LS_STAT:
+                        this->list_files_page(this->clients[i].client, client_request, 1);
                         break;
+#endif
+
+#if MFS_ENABLE_STAT
+                    case OP_STAT:
+                        this->stat_file(this->clients[i].client, file_index, client_request);
+                        break;
+#endif
 
                     case OP_NOOP:
                         this->send_mfs_message(noop_response, this->clients[i].client);
                         break;
 
+#if MFS_ENABLE_READ_MANY
+                    case OP_READ_MANY:
+                        this->read_many(this->clients[i].client, client_request);
+                        break;
+#endif
+
+#if MFS_ENABLE_READ_IF
+                    case OP_READ_IF:
+                        this->conditional_read(i, file_index, client_request);
+                        break;
+#endif
+
+#if MFS_ENABLE_STREAMING
+                    case OP_SETUP:
+                        this->handle_setup(i, client_request);
+                        break;
+
+                    case OP_CREDIT:
+                        this->handle_credit(i, client_request);
+                        break;
+
+                    case OP_RESUME:
+                        this->handle_resume(i, client_request);
+                        break;
+#endif
+
+#if MFS_ENABLE_SUBSCRIBE
+                    case OP_SUBSCRIBE:
+                        this->handle_subscribe(i, file_index, client_request);
+                        break;
+#endif
+
+#if MFS_ENABLE_WRITE
+                    case OP_CHUNK:
+                        this->handle_write_chunk(i, file_index, client_request);
+                        break;
+#endif
+
                     case OP_READ:
-                        // Call file's callback.
-                        this->send_mfs_message(this->files[file_index].reader_f(client_request), this->clients[i].client);
+#if MFS_ENABLE_STREAMING
+                        if (this->files[file_index].chunk_reader_f != 0 && (!this->has_reader(file_index) || this->clients[i].window != 0) && !this->split_mode()) {
+                            // Streamed file. The chunks are sent by pump_stream() over the next passes.
+                            this->start_stream(i, file_index, client_request);
+                            break;
+                        }
+#endif
+                        if (!this->has_reader(file_index)) {
+                            // Write-only file.
+                            this->send_mfs_error(client_request, this->clients[i].client, 1002);
+                            break;
+                        }
+#if MFS_ENABLE_SPLIT
+                        if (this->jobs != 0) {
+                            // A derived file's cache lives on this core, a hit doesn't need the handler core.
+                            mfs_message_t cached = client_request;
+                            if (this->cached_read(file_index, &cached)) this->send_mfs_message(cached, this->clients[i].client);
+                            else this->queue_job(i, file_index, client_request);
+                            break;
+                        }
+#endif
+                        // Call file's callback. (Or reuse its answer to an identical read earlier in this pass.)
+                        this->send_mfs_message(this->shared_read(file_index, this->clients[i].client, client_request), this->clients[i].client);
                         break;
 
+#if MFS_ENABLE_WRITE
                     case OP_WRITE:
-                        this->send_mfs_message(this->files[file_index].writer_f(client_request), this->clients[i].client);
+                        if (!this->has_writer(file_index)) {
+                            // Read-only file.
+                            this->send_mfs_error(client_request, this->clients[i].client, 1002);
+                            break;
+                        }
+#if MFS_ENABLE_SPLIT
+                        if (this->jobs != 0) {
+                            this->queue_job(i, file_index, client_request);
+                            break;
+                        }
+#endif
+                        this->write_file(this->clients[i].client, file_index, client_request);
                         break;
+#endif
 
                     default:
                         if (client_request.op < MFS_RESERVED_OP_RANGE) {
@@ -481,17 +2408,371 @@ public:
     */
 
     // Loops over client list, accepts new clients into the buffer.
+    // New clients get their timeout armed here, otherwise they would expire on the very next pass.
     void accept_clients() {
+        this->refresh_clock();
         for (unsigned long long i = 0; i < this->clients_len; i++) {
-            if (this->clients[i].client == 0) this->clients[i].client = this->accept_client();
+            if (this->clients[i].client != 0) continue;
+            this->clients[i].client = this->accept_client();
+            if (this->clients[i].client == 0) continue; // Nobody waiting, leave the slot alone.
+            this->clients[i].timer_end = this->now_ms + this->timer_ms;
+            this->clients[i].ready = 1; // It may have sent something before we noticed it.
+#if MFS_ENABLE_CAPTURE
+            if (this->capture != 0) this->capture_record(MFS_CAPTURE_ACCEPT, this->clients[i].client, 0, 0);
+#endif
+        }
+    }
+
+#if MFS_ENABLE_SPLIT
+    // Turns on split mode: transport I/O on one core, handlers on another. jobs bounds how many requests can be in flight,
+    // queue_slots has to hold 2 * jobs_len entries. The I/O core then calls serve_io() (instead of serve_clients()) and accept_clients(),
+    // the handler core calls serve_handlers(). Everything else (registering files included) stays on the I/O core. unregister_file() refuses a file
+    // while a request to it is in flight, the handler core may still be calling into it. Derived files are cached on the I/O core, only misses are offloaded.
+    // Handlers never run on the I/O core: OP_READ, OP_READ_IF and OP_WRITE go through jobs, the ops that would call handlers there are refused with
+    // error 3003 (OP_READ_MANY, OP_SUBSCRIBE, OP_CHUNK, OP_RESUME and reads of files that can only be streamed.) Files with a reader are never streamed,
+    // writes always land in the data buffer, and streams or subscriptions carried over by import_state() or a resumed session end on their next pass.
+    void enable_split(mfs_job_t* jobs, unsigned int jobs_len, unsigned int* queue_slots) {
+        for (unsigned int i = 0; i < jobs_len; i++) jobs[i].in_use = 0;
+        this->job_requests = {queue_slots, jobs_len, 0, 0};
+        this->job_responses = {queue_slots + jobs_len, jobs_len, 0, 0};
+        this->jobs_len = jobs_len;
+        this->jobs = jobs;
+    }
+
+    // The I/O core's loop body in split mode. Sends the responses that came back from the handler core, then serves the clients as usual.
+    void serve_io() {
+        this->complete_jobs();
+        this->serve_clients();
+    }
+
+    // The handler core's loop body in split mode. Runs the handlers of every queued request, returns how many it ran.
+    // The response is copied into the job, the handler's buffers are only good until its next call. Responses that don't fit are answered with an error.
+    unsigned int serve_handlers() {
+        unsigned int index, ran = 0;
+        while (mfs_spsc_pop(&this->job_requests, &index) == 0) {
+            mfs_job_t* job = &this->jobs[index];
+            mfs_message_t request = this->job_handler_request(job);
+            mfs_message_t response;
+            if (request.op == OP_WRITE) {
+                if (job->writer_ctx_f != 0) response = job->writer_ctx_f(job->context, job->file_index, job->client, request);
+                else response = job->writer_f(request);
+            } else {
+                if (job->reader_ctx_f != 0) response = job->reader_ctx_f(job->context, job->file_index, job->client, request);
+                else response = job->reader_f(request);
+            }
+
+            unsigned int used = job->request.psize + job->request.dsize;
+            if ((unsigned long long)used + response.psize + response.dsize > job->bsize) {
+                // Doesn't fit. complete_jobs() sends the error, the handler core has no business with the data buffer.
+                response.data = 0;
+            } else {
+                this->memcpy(response.psize, response.path, job->buffer, used);
+                this->memcpy(response.dsize, response.data, job->buffer, used + response.psize);
+                response.path = job->buffer + used;
+                response.data = job->buffer + used + response.psize;
+            }
+            job->response = response;
+            mfs_spsc_push(&this->job_responses, index);
+            ran++;
         }
+        return ran;
+    }
+#endif
+
+#if MFS_ENABLE_EVENTS
+    // Turns on event driven mode. bits has to hold mfs_event_words(files, clients) words, all zero.
+    // From then on, interrupts post events with mark_changed(), signal_readable() and wake(), which the next serve_clients() pass picks up.
+    // Clients are only polled for requests after signal_readable(), so the transport has to signal every time data arrives.
+    void enable_events(unsigned int* bits) {
+        this->file_event_words = (this->files_bsize + 31) / 32;
+        this->event_bits = bits;
+    }
+
+    // ISR-safe. Marks the file at index (see find_file()) as changed, as if update_file() was called. Wait-free, a single atomic OR.
+    void mark_changed(unsigned int file_index) {
+        if (this->event_bits == 0 || file_index >= this->files_bsize) return;
+        __atomic_fetch_or(&this->event_bits[file_index / 32], 1u << (file_index % 32), __ATOMIC_RELEASE);
+        __atomic_store_n(&this->wake_flag, 1, __ATOMIC_RELEASE);
+    }
+
+    // ISR-safe. Tells the server client has data waiting. Bounded by the number of client slots.
+    void signal_readable(client_t client) {
+        if (this->event_bits == 0 || client == 0) return;
+        for (unsigned int i = 0; i < this->clients_len; i++) {
+            if (__atomic_load_n(&this->clients[i].client, __ATOMIC_RELAXED) != client) continue;
+            __atomic_fetch_or(&this->event_bits[this->file_event_words + i / 32], 1u << (i % 32), __ATOMIC_RELEASE);
+            break;
+        }
+        __atomic_store_n(&this->wake_flag, 1, __ATOMIC_RELEASE);
+    }
+
+    // ISR-safe. Asks for a serve pass without any particular event (a new connection, a timer.)
+    void wake() {
+        __atomic_store_n(&this->wake_flag, 1, __ATOMIC_RELEASE);
+    }
+
+    // Returns 1 if something was posted since the last pass, so the main loop can sleep until then: `while (!server.has_events()) __WFI();`
+    // Timeouts still need a pass every now and then, wake() from a timer takes care of that.
+    int has_events() {
+        return __atomic_load_n(&this->wake_flag, __ATOMIC_ACQUIRE) != 0;
+    }
+#endif
+
+#if MFS_ENABLE_HANDOFF
+    // Serialises what a new process needs to take over the clients without them noticing: every client's timeout and stream, flow control, CRC and
+    // subscription state, the resumable transfers, the sessions (live and dormant), the file versions (so client caches stay valid) and the registry generation (see OP_LS_CHANGES.) Requests are always read whole within a pass,
+    // so there is no partial parse state; whatever a client sent since stays in its socket. Call it between passes.
+    // The sockets themselves (listener and clients) are the host's business, on POSIX they go over a Unix socket with SCM_RIGHTS next to this buffer.
+    // Returns the number of bytes written, or -1 if they don't fit (or split mode still has jobs in flight.)
+    long long export_state(char* buffer, unsigned int size) {
+        unsigned int at = 0;
+        this->handoff_put(buffer, size, &at, MFS_HANDOFF_MAGIC, 4);
+#if MFS_ENABLE_LS
+        this->handoff_put(buffer, size, &at, this->generation, 4);
+#else
+        this->handoff_put(buffer, size, &at, 0, 4);
+#endif
+
+        unsigned int count = 0;
+        for (unsigned int i = 0; i < this->files_bsize; i++) count += this->files[i].path_len != 0;
+        this->handoff_put(buffer, size, &at, count, 4);
+        for (unsigned int i = 0; i < this->files_bsize; i++) {
+            if (this->files[i].path_len == 0) continue;
+            this->handoff_put_file(buffer, size, &at, i + 1);
+            this->handoff_put(buffer, size, &at, this->files[i].version, 4);
+        }
+
+#if MFS_ENABLE_SPLIT
+        // A job still in flight may be calling into a file or about to bump its version, even if its client is gone.
+        for (unsigned int i = 0; i < this->jobs_len; i++) {
+            if (this->jobs[i].in_use) return -1;
+        }
+#endif
+        count = 0;
+        for (unsigned int i = 0; i < this->clients_len; i++) count += this->clients[i].client != 0;
+        this->handoff_put(buffer, size, &at, count, 4);
+        for (unsigned int i = 0; i < this->clients_len; i++) {
+            client_handlers_t* client = &this->clients[i];
+            if (client->client == 0) continue;
+            this->handoff_put(buffer, size, &at, client->client, 4);
+            this->handoff_put(buffer, size, &at, client->timer_end > this->now_ms ? client->timer_end - this->now_ms : 0, 4);
+            this->handoff_put_file(buffer, size, &at, client->stream_file);
+            this->handoff_put(buffer, size, &at, client->stream_offset, 8);
+            this->handoff_put(buffer, size, &at, client->stream_transfer != 0 ? this->transfers[client->stream_transfer - 1].id : 0, 4);
+            this->handoff_put(buffer, size, &at, client->window, 4);
+            this->handoff_put(buffer, size, &at, client->credit, 4);
+            this->handoff_put(buffer, size, &at, client->crc, 1);
+            this->handoff_put_file(buffer, size, &at, client->sub_file);
+            this->handoff_put(buffer, size, &at, client->sub_version, 4);
+            this->handoff_put(buffer, size, &at, client->sub_mode, 1);
+        }
+
+        count = 0;
+        for (unsigned int i = 0; i < this->transfers_len; i++) count += this->transfers[i].id != 0;
+        this->handoff_put(buffer, size, &at, this->next_transfer_id, 4);
+        this->handoff_put(buffer, size, &at, count, 4);
+        for (unsigned int i = 0; i < this->transfers_len; i++) {
+            mfs_transfer_t* t = &this->transfers[i];
+            if (t->id == 0) continue;
+            this->handoff_put(buffer, size, &at, t->id, 4);
+            this->handoff_put_file(buffer, size, &at, t->file);
+            this->handoff_put(buffer, size, &at, t->direction, 1);
+            this->handoff_put(buffer, size, &at, t->committed, 8);
+            this->handoff_put(buffer, size, &at, t->owner, 4);
+            this->handoff_put(buffer, size, &at, t->expires > this->now_ms ? t->expires - this->now_ms : 0, 4);
+        }
+
+        // A live session's state is in its client, the session only has to remember who owns it.
+        count = 0;
+#if MFS_ENABLE_SESSIONS
+        for (unsigned int i = 0; i < this->sessions_len; i++) count += this->sessions[i].token != 0;
+#endif
+        this->handoff_put(buffer, size, &at, count, 4);
+#if MFS_ENABLE_SESSIONS
+        for (unsigned int i = 0; i < this->sessions_len; i++) {
+            mfs_session_t* session = &this->sessions[i];
+            if (session->token == 0) continue;
+            this->handoff_put(buffer, size, &at, session->token, 4);
+            this->handoff_put(buffer, size, &at, session->owner, 4);
+            this->handoff_put(buffer, size, &at, session->expires > this->now_ms ? session->expires - this->now_ms : 0, 4);
+            this->handoff_put(buffer, size, &at, session->window, 4);
+            this->handoff_put(buffer, size, &at, session->crc, 1);
+            this->handoff_put_file(buffer, size, &at, session->sub_file);
+            this->handoff_put(buffer, size, &at, session->sub_version, 4);
+            this->handoff_put(buffer, size, &at, session->sub_mode, 1);
+        }
+#endif
+        if (at > size) return -1;
+        return at;
+    }
+
+    // Takes over the state export_state() wrote in the old process. Register the files first, the state refers to them by path.
+    // remap translates the old process' client_t to the new one (the fd numbers received over SCM_RIGHTS), NULL if they are the same.
+    // Clients that don't fit the client slots are closed, streams, subscriptions and transfers of files that aren't registered anymore are dropped.
+    // Sessions that don't fit the session table (or all of them, without enable_sessions()) are dropped too, their clients get a new token on their next OP_SETUP.
+    // Returns 0 on success, -1 if the buffer is malformed (whatever was parsed up to there is kept.) Subscribers get a full update on their next change, the delta bases don't survive.
+    int import_state(char* buffer, unsigned int size, remap_cb remap) {
+        unsigned int at = 0;
+        this->refresh_clock();
+        if (this->handoff_get(buffer, size, &at, 4) != MFS_HANDOFF_MAGIC) return -1;
+#if MFS_ENABLE_LS
+        unsigned int generation = this->handoff_get(buffer, size, &at, 4);
+        // Clients know the old process' generations, which mean nothing to our journal (it only has our registrations.)
+        // Carry on past the old generation with an empty journal: any client asking for changes gets the full list once, then deltas again.
+        if (generation + 1 > this->generation) this->generation = generation + 1;
+        this->journal_used = 0;
+        this->journal_floor = this->generation;
+#else
+        this->handoff_get(buffer, size, &at, 4); // The old process' generation, no use without OP_LS_CHANGES.
+#endif
+
+        unsigned int count = this->handoff_get(buffer, size, &at, 4);
+        for (unsigned int i = 0; i < count && at <= size; i++) {
+            unsigned int file = this->handoff_get_file(buffer, size, &at);
+            unsigned int version = this->handoff_get(buffer, size, &at, 4);
+            if (file != 0) this->files[file - 1].version = version;
+        }
+
+        // Streams are tied to transfers by id, and the transfers come later. Remember the ids for now.
+        count = this->handoff_get(buffer, size, &at, 4);
+        for (unsigned int i = 0; i < count && at <= size; i++) {
+            client_t id = this->handoff_get(buffer, size, &at, 4);
+            if (remap != 0) id = remap(id);
+            client_handlers_t* client = 0;
+            for (unsigned int j = 0; j < this->clients_len && client == 0; j++) {
+                if (this->clients[j].client == 0) client = &this->clients[j];
+            }
+            client_handlers_t dummy;
+            if (client == 0) {
+                // No room, parse it anyway and let it go.
+                this->client_killer(id);
+                client = &dummy;
+            }
+            client->client = id;
+            client->timer_end = this->now_ms + this->handoff_get(buffer, size, &at, 4);
+            client->stream_file = this->handoff_get_file(buffer, size, &at, MFS_STREAM_LOST); // The client hears about a stream that can't go on, see pump_stream().
+            client->stream_offset = this->handoff_get(buffer, size, &at, 8);
+            client->stream_transfer = this->handoff_get(buffer, size, &at, 4);
+            client->window = this->handoff_get(buffer, size, &at, 4);
+            client->credit = this->handoff_get(buffer, size, &at, 4);
+            client->crc = this->handoff_get(buffer, size, &at, 1);
+            client->sub_file = this->handoff_get_file(buffer, size, &at);
+            client->sub_version = this->handoff_get(buffer, size, &at, 4);
+            client->sub_mode = this->handoff_get(buffer, size, &at, 1);
+            client->sub_base = 0;
+            client->sub_deltas = 0;
+            client->job = 0;
+            client->ready = 1;
+            client->session = 0; // Linked back up when the sessions come.
+            // This process' limits apply from here on.
+            if (client->window > this->max_window) client->window = this->max_window;
+            if (client->credit > this->max_window) client->credit = this->max_window;
+            if (client->stream_file == 0 || client->stream_file == MFS_STREAM_LOST) client->stream_offset = 0;
+            if (client->stream_file == MFS_STREAM_LOST) client->stream_transfer = 0;
+            if (client->sub_file == 0) client->sub_mode = 0;
+        }
+
+        this->next_transfer_id = this->handoff_get(buffer, size, &at, 4);
+        if (this->next_transfer_id == 0) this->next_transfer_id = 1;
+        count = this->handoff_get(buffer, size, &at, 4);
+        for (unsigned int i = 0; i < this->transfers_len; i++) this->transfers[i].id = 0;
+        unsigned int slot = 0;
+        for (unsigned int i = 0; i < count && at <= size; i++) {
+            mfs_transfer_t t;
+            t.id = this->handoff_get(buffer, size, &at, 4);
+            t.file = this->handoff_get_file(buffer, size, &at);
+            t.direction = this->handoff_get(buffer, size, &at, 1);
+            t.committed = this->handoff_get(buffer, size, &at, 8);
+            t.owner = this->handoff_get(buffer, size, &at, 4);
+            t.expires = this->now_ms + this->handoff_get(buffer, size, &at, 4);
+            if (t.file == 0 || slot == this->transfers_len) continue;
+            if (t.owner != 0 && remap != 0) t.owner = remap(t.owner);
+            this->transfers[slot++] = t;
+        }
+
+        // Now the stream ids can be turned back into transfer slots.
+        for (unsigned int i = 0; i < this->clients_len; i++) {
+            client_handlers_t* client = &this->clients[i];
+            if (client->client == 0 || client->stream_transfer == 0) continue;
+            mfs_transfer_t* t = this->find_transfer(client->stream_transfer);
+            client->stream_transfer = t != 0 ? (t - this->transfers) + 1 : 0;
+        }
+        // Transfers of clients that got closed for lack of a slot go dormant, their fd may be reused by the next connection.
+        for (unsigned int i = 0; i < slot; i++) {
+            mfs_transfer_t* t = &this->transfers[i];
+            if (t->owner == 0) continue;
+            unsigned int j = 0;
+            for (; j < this->clients_len && this->clients[j].client != t->owner; j++);
+            if (j < this->clients_len) continue;
+            t->owner = 0;
+            t->expires = this->now_ms + this->transfer_ttl_ms;
+        }
+
+        count = this->handoff_get(buffer, size, &at, 4);
+#if MFS_ENABLE_SESSIONS
+        for (unsigned int i = 0; i < this->sessions_len; i++) this->sessions[i].token = 0;
+        slot = 0;
+        for (unsigned int i = 0; i < count && at <= size; i++) {
+            mfs_session_t session;
+            session.token = this->handoff_get(buffer, size, &at, 4);
+            session.owner = this->handoff_get(buffer, size, &at, 4);
+            session.expires = this->now_ms + this->handoff_get(buffer, size, &at, 4);
+            session.window = this->handoff_get(buffer, size, &at, 4);
+            if (session.window > this->max_window) session.window = this->max_window;
+            session.crc = this->handoff_get(buffer, size, &at, 1);
+            session.sub_file = this->handoff_get_file(buffer, size, &at);
+            session.sub_version = this->handoff_get(buffer, size, &at, 4);
+            session.sub_mode = this->handoff_get(buffer, size, &at, 1);
+            if (session.token == 0 || slot == this->sessions_len) continue;
+            if (session.owner != 0 && remap != 0) session.owner = remap(session.owner);
+            // Link a live session back to its client. If the client got closed for lack of a slot, the session goes dormant instead.
+            int is_linked = 0;
+            for (unsigned int j = 0; j < this->clients_len && session.owner != 0; j++) {
+                if (this->clients[j].client != session.owner) continue;
+                this->clients[j].session = slot + 1;
+                is_linked = 1;
+                break;
+            }
+            if (session.owner != 0 && !is_linked) {
+                session.owner = 0;
+                session.expires = this->now_ms + this->session_ttl_ms;
+            }
+            this->sessions[slot++] = session;
+        }
+#else
+        for (unsigned int i = 0; i < count && at <= size; i++) {
+            at += 4 + 4 + 4 + 4 + 1; // token, owner, expires, window, crc
+            this->handoff_get_file(buffer, size, &at);
+            at += 4 + 1; // sub_version, sub_mode
+        }
+#endif
+        return at <= size ? 0 : -1;
+    }
+#endif
+
+#if MFS_ENABLE_SESSIONS
+    // Turns on session resumption, see MFS_SETUP_SESSION. table bounds how many sessions (live and dormant) there can be, entries should be zero initially.
+    // Dormant sessions are kept for session_ttl_ms, or until their slot is needed by a new session after that.
+    void enable_sessions(mfs_session_t* table, unsigned int table_len) {
+        this->token_state = ((unsigned int)this->millis() ^ (unsigned int)(unsigned long long)table ^ 0x9E3779B9) | 1; // xorshift never leaves 0.
+        this->sessions = table;
+        this->sessions_len = table_len;
+    }
+#endif
+
+    // Looks up the file at path. Returns its index (for mark_changed()), or -1 if it doesn't exist.
+    long long find_file(char* path, unsigned int path_size) {
+        return this->get_file_index(path, path_size);
     }
 
     // Registers a new file with the server object.
     // Returns 0 on success, 1 on error.
     int register_file(mfs_file_t* newfile) {
+        unsigned int hash;
+        long long len = this->scan_path(newfile->path, newfile->path_size, &hash);
+        if (len == -1) return 1; // Not a valid path.
         // First, check if the path is already used.
-        if (this->get_file_index(newfile->path, this->strlen(newfile->path, newfile->path_size)) != -1) return 1; // File exists, so we cannot add this file
+        if (this->get_file_index(newfile->path, newfile->path_size) != -1) return 1; // File exists, so we cannot add this file
         // Now, find an empty slot to put it in.
         unsigned int empty_slot_index = 0;
         int found_empty_slot = 0;
@@ -506,28 +2787,81 @@ public:
 
         this->files[empty_slot_index].path = newfile->path;
         this->files[empty_slot_index].path_size = newfile->path_size;
+        this->files[empty_slot_index].path_len = len;
+        this->files[empty_slot_index].path_hash = hash;
         this->files[empty_slot_index].reader_f = newfile->reader_f;
         this->files[empty_slot_index].writer_f = newfile->writer_f;
+        this->files[empty_slot_index].chunk_reader_f = newfile->chunk_reader_f;
+        this->files[empty_slot_index].chunk_writer_f = newfile->chunk_writer_f;
+        this->files[empty_slot_index].context = newfile->context;
+        this->files[empty_slot_index].reader_ctx_f = newfile->reader_ctx_f;
+        this->files[empty_slot_index].writer_ctx_f = newfile->writer_ctx_f;
+        this->files[empty_slot_index].write_buffer = newfile->write_buffer;
+        this->files[empty_slot_index].write_bsize = newfile->write_bsize;
+        this->files[empty_slot_index].prepare_write_f = newfile->prepare_write_f;
+        this->files[empty_slot_index].derived = newfile->derived;
+        if (newfile->derived != 0) newfile->derived->valid = 0;
+        this->files[empty_slot_index].size = newfile->size;
+        this->files[empty_slot_index].version = newfile->version;
+        this->files[empty_slot_index].priority = newfile->priority;
+#if MFS_ENABLE_LS
+        this->journal_append(MFS_CHANGE_ADDED, newfile->path, len);
+#endif
 
         return 0;
     }
 
     // De-registers file from the files array.
-    // Returns 0 on success, 1 on error.
+    // Returns 0 on success, 1 on error. In split mode that includes a request to the file still being handled, try again after serve_io().
     int unregister_file(char* path, unsigned int path_size) {
         // Check if file exists
-        unsigned int file_index = this->get_file_index(path, this->strlen(path, path_size));
-        if ( file_index == -1) return 1; // File does not exist.
+        long long file_index = this->get_file_index(path, path_size);
+        if (file_index == -1) return 1; // File does not exist.
+#if MFS_ENABLE_SPLIT
+        if (this->jobs != 0 && this->file_has_jobs(file_index)) return 1;
+#endif
+        this->forget_file(file_index);
+#if MFS_ENABLE_LS
+        this->journal_append(MFS_CHANGE_REMOVED, this->files[file_index].path, this->files[file_index].path_len);
+#endif
 
         this->files[file_index].path = 0;
         this->files[file_index].path_size = 0;
+        this->files[file_index].path_len = 0;
+        this->files[file_index].path_hash = 0;
         this->files[file_index].reader_f = 0;
         this->files[file_index].writer_f = 0;
+        this->files[file_index].chunk_reader_f = 0;
+        this->files[file_index].chunk_writer_f = 0;
+        this->files[file_index].context = 0;
+        this->files[file_index].reader_ctx_f = 0;
+        this->files[file_index].writer_ctx_f = 0;
+        this->files[file_index].write_buffer = 0;
+        this->files[file_index].write_bsize = 0;
+        this->files[file_index].prepare_write_f = 0;
+        this->files[file_index].derived = 0;
+        this->files[file_index].size = 0;
+        this->files[file_index].version = 0;
+        this->files[file_index].priority = 0;
+#if MFS_ENABLE_COALESCE
+        this->coalesce_used = 0; // A file registered in this slot later could end up with the same version.
+#endif
+        return 0;
+    }
+
+    // Tells the server that the file at path changed. Bumps its version (and those of derived files depending on it) and updates its size hint.
+    // Writes through OP_WRITE and OP_CHUNK bump the version on their own, this is for changes the server can't see (sensor readings and such.)
+    // Returns 0 on success, 1 if the file does not exist.
+    int update_file(char* path, unsigned int path_size, unsigned int size) {
+        long long file_index = this->get_file_index(path, path_size);
+        if (file_index == -1) return 1;
+        this->touch_file(file_index);
+        this->files[file_index].size = size;
         return 0;
     }
 
     // Finally; The constuctor. The beginning, of it all.
-    mfs_server(read_cb readerf, write_cb writerf, accept_cb acceptf, close_cb closef, get_time_cb timef, available_cb availf, char* dbuf, unsigned int dbuf_size, char* pbuf, unsigned int pbuf_size, client_handlers_t* cbuf, unsigned int cbuf_size, mfs_file_t* fbuf, unsigned int fbuf_size) {
+    mfs_server(read_cb readerf, write_cb writerf, accept_cb acceptf, close_cb closef, get_time_cb timef, available_cb availf, char* dbuf, unsigned int dbuf_size, char* pbuf, unsigned int pbuf_size, client_handlers_t* cbuf, unsigned int cbuf_size, mfs_file_t* fbuf, unsigned int fbuf_size, mfs_transfer_t* tbuf = 0, unsigned int tbuf_size = 0) {
         this->accept_client = acceptf;
         this->client_available = availf;
         this->client_killer = closef;
@@ -542,5 +2876,822 @@ public:
         this->clients_len = cbuf_size;
         this->files = fbuf;
         this->files_bsize = fbuf_size;
+        this->transfers = tbuf; // Optional, without it transfers can't be resumed and chunked uploads are refused.
+        this->transfers_len = tbuf_size;
+    }
+};
+
+// Replays a session capture through an mfs_server, for benchmarking against real traffic instead of synthetic mixes.
+// It stands in for the transport: construct the server with the static callbacks below, activate() the replay and call run().
+// The callbacks have no context arguement, so only one replay can be active at a time.
+// Without a wall clock the replay is deterministic: the server's clock jumps from record to record and everything runs as fast as it can.
+// With a wall clock, records are held back until their time comes, speed times faster than they were captured.
+class mfs_replay {
+    char* log;
+    unsigned long long log_size;
+    unsigned long long position = 0;
+
+    // The record at position. Only valid if have_head is set.
+    int have_head = 0;
+    unsigned char head_type;
+    client_t head_client;
+    unsigned long long head_time;
+    unsigned long long head_left; // Payload bytes not consumed yet.
+    unsigned long long last_time = 0;
+
+    get_time_cb wall;
+    unsigned int speed;
+    unsigned long long wall_start = 0;
+    unsigned long long base_time = 0; // Capture time of the first record, where the wall clock replay starts.
+
+    // Reads a varint at position. Returns 1 on success, 0 if the capture is truncated.
+    int get_varint(unsigned long long* value) {
+        *value = 0;
+        for (unsigned int shift = 0; this->position < this->log_size && shift < 64; shift += 7) {
+            unsigned char byte = this->log[this->position++];
+            *value |= (unsigned long long)(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) return 1;
+        }
+        return 0;
+    }
+
+    // Parses the next record header if needed. Returns 0 at the end of the capture.
+    int load_head() {
+        if (this->have_head) return 1;
+        if (this->position >= this->log_size) return 0;
+        unsigned long long delta, client, size;
+        this->head_type = this->log[this->position++];
+        if (!this->get_varint(&delta) || !this->get_varint(&client) || !this->get_varint(&size)) {
+            this->position = this->log_size; // Truncated capture, treat as the end.
+            return 0;
+        }
+        if (size > this->log_size - this->position) size = this->log_size - this->position;
+        this->last_time += delta;
+        this->head_time = this->last_time;
+        this->head_client = client;
+        this->head_left = size;
+        this->have_head = 1;
+        return 1;
+    }
+
+    // Drops the current record (and whatever is left of its payload.)
+    void next() {
+        this->position += this->head_left;
+        this->have_head = 0;
+    }
+
+    // Returns 1 if the current record is due.
+    int head_due() {
+        if (!this->load_head()) return 0;
+        return this->wall == 0 || this->clock() >= this->head_time;
+    }
+
+public:
+    // The replay the callbacks drive. A function local static rather than a static member, so main.cpp can be included from more than one translation unit.
+    static mfs_replay*& active() {
+        static mfs_replay* replay = 0;
+        return replay;
+    }
+    unsigned long long bytes_out = 0; // Everything the server wrote, so throughput can be computed.
+
+    mfs_replay(char* capture, unsigned long long capture_size, get_time_cb wall_clock = 0, unsigned int replay_speed = 1) {
+        this->log = capture;
+        this->log_size = capture_size;
+        this->wall = wall_clock;
+        this->speed = replay_speed == 0 ? 1 : replay_speed;
+    }
+
+    void activate() {
+        active() = this;
+        if (this->load_head()) this->base_time = this->head_time;
+        if (this->wall != 0) this->wall_start = this->wall();
+    }
+
+    // Returns 1 once every record has been consumed.
+    int done() {
+        return !this->load_head();
+    }
+
+    // The clock the server sees.
+    unsigned long long clock() {
+        if (this->wall != 0) return this->base_time + (this->wall() - this->wall_start) * this->speed;
+        if (this->load_head()) return this->head_time;
+        return this->last_time;
+    }
+
+    // Runs the capture through server until it's over.
+    // A record whose client the server already dropped (timeouts, limits changed since the capture) would block the replay forever,
+    // so a due record that survives a full pass untouched gets skipped. Returns how many records were skipped.
+    unsigned long long run(mfs_server* server) {
+        unsigned long long skipped = 0;
+        while (!this->done()) {
+            unsigned long long before = this->position;
+            int was_due = this->head_due();
+            server->accept_clients();
+            server->serve_clients();
+            if (was_due && this->have_head && this->position == before) {
+                this->next();
+                skipped++;
+            }
+        }
+        return skipped;
+    }
+
+    // Transport callbacks, pass these to the mfs_server constructor.
+    static long long read(client_t client, char* buffer, unsigned long long size) {
+        mfs_replay* r = active();
+        unsigned long long copied = 0;
+        while (copied < size && r->head_due() && r->head_type == MFS_CAPTURE_DATA && r->head_client == client) {
+            unsigned long long n = r->head_left;
+            if (n > size - copied) n = size - copied;
+            for (unsigned long long i = 0; i < n; i++) buffer[copied + i] = r->log[r->position + i];
+            copied += n;
+            r->position += n;
+            r->head_left -= n;
+            if (r->head_left == 0) r->have_head = 0;
+        }
+        return copied;
+    }
+
+    static long long write(client_t /*client*/, char* /*buffer*/, unsigned long long size) {
+        active()->bytes_out += size;
+        return size;
+    }
+
+    static void close(client_t /*client*/) {
+    }
+
+    static unsigned long long available(client_t client) {
+        mfs_replay* r = active();
+        if (client == 0) return 0;
+        if (!r->head_due() || r->head_type != MFS_CAPTURE_DATA || r->head_client != client) return 0;
+        return r->head_left;
+    }
+
+    static client_t accept() {
+        mfs_replay* r = active();
+        if (!r->head_due() || r->head_type != MFS_CAPTURE_ACCEPT) return 0;
+        client_t client = r->head_client;
+        r->next();
+        return client;
+    }
+
+    static unsigned long long time() {
+        return active()->clock();
+    }
+};
+
+// Static RAM needed by one server with the given buffer sizes, in bytes: the server itself and the tables and buffers handed to its constructor. (The software CRC tables are const, they live in flash.)
+// mfslib never allocates. The optional buffers are on top of this, their sizes are the application's choice: journal_buffer, delta_buffer, coalesce_buffer,
+// and the tables given to enable_split() (plus 2 * jobs unsigned ints), enable_events() (mfs_event_words()) and enable_sessions().
+// constexpr, so firmware can check its budget at compile time: static_assert(mfs_static_ram(4, 16, 2, 64, 512) <= 4096, "...");
+constexpr unsigned long long mfs_static_ram(unsigned long long clients, unsigned long long files, unsigned long long transfers, unsigned long long path_bsize, unsigned long long data_bsize) {
+    return sizeof(mfs_server) + clients * sizeof(client_handlers_t) + files * sizeof(mfs_file_t) + transfers * sizeof(mfs_transfer_t) + path_bsize + data_bsize;
+}
+
+// A time-series file: a fixed-capacity ring of timestamped samples, oldest overwritten first.
+// Register it with context pointing at the series and reader_ctx_f set to mfs_series_reader. All of the buffers are owned by the application.
+// Call mfs_series_push() to add samples, and update_file() if clients should hear about them (subscribers, OP_READ_IF.)
+// Samples have to be pushed in time order, range queries rely on it.
+typedef struct {
+    unsigned int* times; // Sample timestamps, capacity entries.
+    int* values; // Sample values, capacity entries.
+    unsigned int capacity;
+    char* out; // Responses are built here. Bounds how many points a read can return (8 bytes per point.)
+    unsigned int out_size;
+
+    unsigned int head; // Slot the next sample goes to. Should be zero initially.
+    unsigned int count; // Samples in the ring. Should be zero initially.
+} mfs_series_t;
+
+// Aggregations for mfs_series_reader.
+#define MFS_SERIES_LAST 0
+#define MFS_SERIES_MIN 1
+#define MFS_SERIES_MAX 2
+#define MFS_SERIES_AVG 3
+
+inline void mfs_series_push(mfs_series_t* series, unsigned int time, int value) {
+    series->times[series->head] = time;
+    series->values[series->head] = value;
+    series->head = (series->head + 1) % series->capacity;
+    if (series->count < series->capacity) series->count++;
+}
+
+// Physical slot of the i-th oldest sample.
+inline unsigned int mfs_series_slot(mfs_series_t* series, unsigned int i) {
+    return (series->head + series->capacity - series->count + i) % series->capacity;
+}
+
+// Number of samples older than time. Binary search, the ring is sorted by time.
+inline unsigned int mfs_series_find(mfs_series_t* series, unsigned int time) {
+    unsigned int low = 0, high = series->count;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (series->times[mfs_series_slot(series, mid)] < time) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+// Aggregation kernels over a contiguous run of values. Plain branchless loops, so the compiler can vectorize them (SSE4.1/AVX2, NEON) at -O3.
+inline int mfs_series_min(const int* values, unsigned int n, int acc) {
+    for (unsigned int i = 0; i < n; i++) acc = values[i] < acc ? values[i] : acc;
+    return acc;
+}
+
+inline int mfs_series_max(const int* values, unsigned int n, int acc) {
+    for (unsigned int i = 0; i < n; i++) acc = values[i] > acc ? values[i] : acc;
+    return acc;
+}
+
+inline long long mfs_series_sum(const int* values, unsigned int n, long long acc) {
+    for (unsigned int i = 0; i < n; i++) acc += values[i];
+    return acc;
+}
+
+// Aggregates the samples [first, last) (oldest first). The ring wraps at most once, so that is at most two contiguous runs.
+inline int mfs_series_aggregate(mfs_series_t* series, unsigned int first, unsigned int last, unsigned char aggregation) {
+    unsigned int start = mfs_series_slot(series, first);
+    unsigned int n = last - first;
+    unsigned int run = series->capacity - start < n ? series->capacity - start : n;
+    const int* values = series->values;
+    if (aggregation == MFS_SERIES_MIN) return mfs_series_min(values, n - run, mfs_series_min(values + start, run, values[start]));
+    if (aggregation == MFS_SERIES_MAX) return mfs_series_max(values, n - run, mfs_series_max(values + start, run, values[start]));
+    if (aggregation == MFS_SERIES_AVG) return mfs_series_sum(values, n - run, mfs_series_sum(values + start, run, 0)) / (long long)n;
+    return values[mfs_series_slot(series, last - 1)];
+}
+
+// Reader for mfs_series_t files, see fread_ctx_t. The request's data section is [from (4 bytes)][to (4 bytes)][max points (2 bytes)][aggregation (1 byte)],
+// selecting samples with from <= time <= to. An empty data section reads everything with MFS_SERIES_LAST. A max points of 0 means as many as fit the out buffer.
+// Shorter data sections and unknown aggregations are answered with error 3006.
+// With more samples in range than points, they are split into max points buckets of (nearly) equal sample count, each aggregated into one point.
+// The response's data section is a list of [time (4 bytes)][value (4 bytes)] points, oldest first. A bucket's time is its first sample's, or its last one's for MFS_SERIES_LAST.
+inline mfs_message_t mfs_series_reader(void* context, unsigned int /*file_index*/, client_t /*client*/, mfs_message_t request) {
+    mfs_series_t* series = (mfs_series_t*)context;
+    unsigned int from = 0, to = 0xFFFFFFFF, max_points = 0;
+    unsigned char aggregation = MFS_SERIES_LAST;
+    if (request.dsize != 0) {
+        unsigned char* data = (unsigned char*)request.data;
+        if (request.dsize < 11 || data[10] > MFS_SERIES_AVG) {
+            // Error 3006 (malformed), like the server's own errors. Not in the request's data, that could be a single byte of the data buffer.
+            // An unknown aggregation too, the client would take whatever came back for the aggregate it asked for.
+            static char malformed[2] = {(char)(3006 & 0xFF), (char)(3006 >> 8)};
+            request.op = RESPONSE_OF(OP_ERROR);
+            request.data = malformed;
+            request.dsize = 2;
+            return request;
+        }
+        from = data[0] | (data[1] << 8) | (data[2] << 16) | ((unsigned int)data[3] << 24);
+        to = data[4] | (data[5] << 8) | (data[6] << 16) | ((unsigned int)data[7] << 24);
+        max_points = data[8] | (data[9] << 8);
+        aggregation = data[10];
+    }
+    if (max_points == 0 || max_points > series->out_size / 8) max_points = series->out_size / 8;
+
+    unsigned int first = mfs_series_find(series, from);
+    unsigned int last = to == 0xFFFFFFFF ? series->count : mfs_series_find(series, to + 1);
+    unsigned int n = last > first ? last - first : 0;
+    unsigned int points = n < max_points ? n : max_points;
+    for (unsigned int b = 0; b < points; b++) {
+        unsigned int bucket_first = first + (unsigned long long)n * b / points;
+        unsigned int bucket_last = first + (unsigned long long)n * (b + 1) / points;
+        unsigned int time = series->times[mfs_series_slot(series, aggregation == MFS_SERIES_LAST ? bucket_last - 1 : bucket_first)];
+        unsigned int value = mfs_series_aggregate(series, bucket_first, bucket_last, aggregation);
+        for (unsigned int i = 0; i < 4; i++) {
+            series->out[b * 8 + i] = (time >> (8 * i)) & 0xFF;
+            series->out[b * 8 + 4 + i] = (value >> (8 * i)) & 0xFF;
+        }
+    }
+    request.op = RESPONSE_OF(OP_READ);
+    request.data = series->out;
+    request.dsize = points * 8;
+    return request;
+}
+
+// Called when a pooled request completes (or for every file of mfs_client::read_many().) response is only valid during the call, copy what you need.
+// A response with NULL pointers means the request failed (the connection broke before the response came.)
+typedef void (*mfs_response_cb)(void* context, mfs_message_t response);
+
+// Words of event bits needed by mfs_server::enable_events().
+constexpr unsigned long long mfs_event_words(unsigned long long files, unsigned long long clients) {
+    return (files + 31) / 32 + (clients + 31) / 32;
+}
+
+// A cached file on the client side. The application owns all of the buffers, the cache only fills them.
+// All of the fields (except the buffers and their sizes) should be zero initially.
+typedef struct {
+    char* path; // Buffer for a copy of the path, it is stored NULL-terminated.
+    unsigned int path_size; // Size of the path buffer NOT THE LENGHT OF THE STRING!
+    char* data; // Buffer for the payload.
+    unsigned int data_size; // Size of the payload buffer, larger payloads are simply not cached.
+
+    unsigned int length; // Lenght of the cached payload.
+    unsigned int version; // Server side version of the payload.
+    unsigned char valid;
+} mfs_cache_entry_t;
+
+// MFS client, the other end of mfs_server. Talks over the same kind of blocking read/write callbacks the server uses.
+// Reads go through a cache keyed by path: a cached file is revalidated with OP_READ_IF, which costs the server a version compare instead of a reader call.
+// With push_invalidation set, cached files are served without asking the server at all. The application then has to call invalidate() whenever it learns a file changed.
+// Like the server, it is NOT thread-safe.
+class mfs_client {
+    client_t connection;
+    read_cb server_reader;
+    write_cb server_writer;
+
+    // Responses are read into this buffer, path first and data right after it.
+    char* buffer;
+    unsigned int bsize;
+
+    mfs_cache_entry_t* cache;
+    unsigned int cache_len;
+    unsigned int next_victim = 0; // Round robin eviction.
+
+    void fill_headers(char* header, mfs_message_t msg) {
+        for (unsigned int i = 0; i < 4; i++) {
+            header[i] = (msg.psize >> (8 * i)) & 0xFF;
+            header[4 + i] = (msg.dsize >> (8 * i)) & 0xFF;
+        }
+        header[8] = msg.op;
+    }
+
+    unsigned int get_uint(char* data, unsigned int size) {
+        unsigned int value = 0;
+        for (unsigned int i = 0; i < size && i < 4; i++) value |= (unsigned int)(unsigned char)data[i] << (8 * i);
+        return value;
+    }
+
+    // Lenght of the C-string in buf, 0 if there is no terminator within buf_size.
+    unsigned int strlen(char* buf, unsigned int buf_size) {
+        unsigned int len = 0;
+        for (; len < buf_size; len++) {
+            if (buf[len] == '\0') return len;
+        }
+        return 0;
+    }
+
+    // Reads a varint (see the capture format) from buf at *at, and moves *at past it. Returns -1 if it runs off the end of buf.
+    int get_varint(char* buf, unsigned int size, unsigned int* at, unsigned long long* value) {
+        *value = 0;
+        for (unsigned int shift = 0; *at < size && shift < 64; shift += 7) {
+            unsigned char byte = buf[(*at)++];
+            *value |= (unsigned long long)(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) return 0;
+        }
+        return -1;
+    }
+
+    // Finds the cache entry for path (len is the lenght of the string.) Returns NULL on a miss.
+    mfs_cache_entry_t* find_entry(char* path, unsigned int len) {
+        for (unsigned int i = 0; i < this->cache_len; i++) {
+            mfs_cache_entry_t* entry = &this->cache[i];
+            if (!entry->valid || this->strlen(entry->path, entry->path_size) != len) continue;
+            unsigned int j = 0;
+            for (; j < len && entry->path[j] == path[j]; j++);
+            if (j == len) return entry;
+        }
+        return 0;
+    }
+
+    // Picks an entry to cache path in, or NULL if none of the entries can hold the path.
+    mfs_cache_entry_t* claim_entry(char* path, unsigned int len) {
+        for (unsigned int tries = 0; tries < this->cache_len; tries++) {
+            mfs_cache_entry_t* entry = &this->cache[this->next_victim];
+            this->next_victim = (this->next_victim + 1) % this->cache_len;
+            if (entry->path_size <= len) continue; // Path (and its terminator) doesn't fit.
+            for (unsigned int j = 0; j < len; j++) entry->path[j] = path[j];
+            entry->path[len] = '\0';
+            entry->valid = 0;
+            return entry;
+        }
+        return 0;
+    }
+
+    // Sends a request, the path goes out NULL-terminated like the server expects it. data may be split in a prefix and the rest, to avoid copying.
+    int send_request(unsigned char op, char* path, unsigned int len, char* prefix, unsigned int prefix_size, char* data, unsigned int dsize) {
+        mfs_message_t msg;
+        msg.op = op;
+        msg.psize = len + 1;
+        msg.dsize = prefix_size + dsize;
+        char header[9];
+        this->fill_headers(header, msg);
+        char terminator = '\0';
+        if (this->server_writer(this->connection, header, 9) != 9) return -1;
+        if (len != 0 && this->server_writer(this->connection, path, len) != len) return -1;
+        if (this->server_writer(this->connection, &terminator, 1) != 1) return -1;
+        if (prefix_size != 0 && this->server_writer(this->connection, prefix, prefix_size) != prefix_size) return -1;
+        if (dsize != 0 && this->server_writer(this->connection, data, dsize) != dsize) return -1;
+        return 0;
+    }
+
+public:
+    unsigned char push_invalidation = 0; // Trust the cache without revalidating, see the class comment.
+
+    client_t get_connection() {
+        return this->connection;
+    }
+
+    // Switches the client over to another connection (after a reconnect, for example.)
+    void set_connection(client_t conn) {
+        this->connection = conn;
+    }
+
+    // Returns 0 if msg asks for something this client can't talk: an OP_SETUP turning on CRC trailers (see MFS_SETUP_CRC), the client frames without them.
+    int supports(mfs_message_t msg) {
+        if (msg.op != OP_SETUP) return 1;
+        for (unsigned int i = 0; i + 2 <= msg.dsize;) {
+            unsigned char key = msg.data[i];
+            unsigned char len = msg.data[i + 1];
+            i += 2;
+            if (i + len > msg.dsize) break;
+            if (key == MFS_SETUP_CRC && this->get_uint(msg.data + i, len) != 0) return 0;
+            i += len;
+        }
+        return 1;
+    }
+
+    // Sends a request without waiting for the response, for pipelining. Returns 0 on success, -1 on error (or if the request isn't supported, see supports().)
+    // The path has to be NULL-terminated within psize, same as the server expects it.
+    int send(mfs_message_t msg) {
+        if (!this->supports(msg)) return -1;
+        return this->send_request(msg.op, msg.path, this->strlen(msg.path, msg.psize), 0, 0, msg.data, msg.dsize);
+    }
+
+    // Reads the next message from the server into the response buffer.
+    // Returns a message with NULL pointers if reading fails or the message doesn't fit the buffer (it is drained in that case, so the connection stays usable.)
+    mfs_message_t receive() {
+        mfs_message_t result = {.psize = 0, .dsize = 0, .op = RESPONSE_OF(OP_ERROR), .path = 0, .data = 0};
+        char header[9];
+        if (this->server_reader(this->connection, header, 9) != 9) return result;
+        unsigned int psize = this->get_uint(header, 4);
+        unsigned int dsize = this->get_uint(header + 4, 4);
+        unsigned char op = header[8];
+        if ((unsigned long long)psize + dsize > this->bsize) {
+            // Too large, drain it.
+            for (unsigned long long left = (unsigned long long)psize + dsize; left > 0;) {
+                unsigned int chunk = left > this->bsize ? this->bsize : left;
+                if (this->server_reader(this->connection, this->buffer, chunk) != chunk) break;
+                left -= chunk;
+            }
+            return result;
+        }
+        if (this->server_reader(this->connection, this->buffer, psize + dsize) != psize + dsize) return result;
+        result.op = op;
+        result.psize = psize;
+        result.dsize = dsize;
+        result.path = this->buffer;
+        result.data = this->buffer + psize;
+        // Pushed updates keep the cache current, whoever happens to be receiving.
+        if (op == RESPONSE_OF(OP_SUBSCRIBE) && dsize >= MFS_UPDATE_HEADER) this->apply_update(result);
+        return result;
+    }
+
+    // Applies a pushed update (see MFS_UPDATE_FULL) to the cached copy of its file. receive() does this on its own.
+    // A delta that doesn't apply (no cached copy at its base version, or a malformed one) drops the cached copy instead. The next full update or read brings it back.
+    // Returns 0 if the cache holds the updated file, -1 otherwise.
+    int apply_update(mfs_message_t update) {
+        if (update.dsize < MFS_UPDATE_HEADER) return -1;
+        unsigned int len = this->strlen(update.path, update.psize);
+        if (len == 0) return -1;
+        mfs_cache_entry_t* entry = this->find_entry(update.path, len);
+        char* payload = update.data + MFS_UPDATE_HEADER;
+        unsigned int size = update.dsize - MFS_UPDATE_HEADER;
+        unsigned int version = this->get_uint(update.data + 5, 4);
+
+        if (update.data[0] == MFS_UPDATE_FULL) {
+            if (entry == 0) entry = this->claim_entry(update.path, len);
+            if (entry == 0) return -1;
+            if (size > entry->data_size) {
+                entry->valid = 0;
+                return -1;
+            }
+            for (unsigned int i = 0; i < size; i++) entry->data[i] = payload[i];
+            entry->length = size;
+            entry->version = version;
+            entry->valid = 1;
+            return 0;
+        }
+
+        if (entry == 0) return -1;
+        if (update.data[0] != MFS_UPDATE_DELTA || entry->version != this->get_uint(update.data + 1, 4) || size < 4 || this->get_uint(payload, 4) > entry->data_size) {
+            entry->valid = 0;
+            return -1;
+        }
+        unsigned int new_len = this->get_uint(payload, 4);
+        unsigned long long pos = 0;
+        for (unsigned int at = 4; at < size;) {
+            unsigned long long skip, patch_len;
+            if (this->get_varint(payload, size, &at, &skip) != 0 || this->get_varint(payload, size, &at, &patch_len) != 0
+                || patch_len > size - at || pos + skip + patch_len > new_len) {
+                entry->valid = 0;
+                return -1;
+            }
+            pos += skip;
+            for (unsigned int i = 0; i < patch_len; i++) entry->data[pos + i] = payload[at + i];
+            at += patch_len;
+            pos += patch_len;
+        }
+        entry->length = new_len;
+        entry->version = version;
+        return 0;
+    }
+
+    // Reads every file matching filter (a prefix or glob, see OP_READ_MANY) with one request. cb is called with each file's frame as it arrives.
+    // The frames live in the response buffer only until cb returns. Files whose reader failed come with the server's OP_ERROR response.
+    // Returns the number of files read, or -1 on error.
+    long long read_many(char* filter, unsigned int filter_len, mfs_response_cb cb, void* context) {
+        if (this->send_request(OP_READ_MANY, 0, 0, 0, 0, filter, filter_len) != 0) return -1;
+        while (1) {
+            mfs_message_t response = this->receive();
+            if (response.path == 0) return -1;
+            if (this->strlen(response.path, response.psize) == 0) {
+                // The closing frame, or the server rejecting the request (its errors echo our empty path.) Files always come with theirs.
+                if (response.op != RESPONSE_OF(OP_READ_MANY) || response.dsize < 4) return -1;
+                return this->get_uint(response.data, 4);
+            }
+            if (response.op == RESPONSE_OF(OP_READ_MANY) || response.op == RESPONSE_OF(OP_ERROR)) cb(context, response);
+        }
+    }
+
+    // Subscribes to the file at path, mode is one of MFS_SUBSCRIBE_*. The server allows one subscription per connection, subscribing again replaces it.
+    // Waits for the first (full) update, so the file is cached when this returns. Later updates are applied by receive(), keep calling it while the connection is readable.
+    // Best combined with push_invalidation, reads are then served from the cache without a round trip.
+    // Returns 0 on success, -1 on error.
+    int subscribe(char* path, unsigned int path_size, unsigned char mode) {
+        unsigned int len = this->strlen(path, path_size);
+        if (len == 0) return -1;
+        if (this->send_request(OP_SUBSCRIBE, path, len, 0, 0, (char*)&mode, 1) != 0) return -1;
+        // The acknowledgement is the one with a single byte of data, anything larger is an update (maybe from the previous subscription.)
+        mfs_message_t response;
+        do {
+            response = this->receive();
+            if (response.path == 0 || response.op == RESPONSE_OF(OP_ERROR)) return -1;
+        } while (response.op != RESPONSE_OF(OP_SUBSCRIBE) || response.dsize != 1);
+        if (mode == MFS_SUBSCRIBE_OFF) return 0;
+        do {
+            response = this->receive();
+            if (response.path == 0 || response.op == RESPONSE_OF(OP_ERROR)) return -1;
+        } while (response.op != RESPONSE_OF(OP_SUBSCRIBE));
+        return 0;
+    }
+
+    // Sends a request and waits for its response. Messages that aren't the response (stream chunks for example) are skipped.
+    // Returns a message with NULL pointers on failure. The response lives in the response buffer until the next call.
+    mfs_message_t request(mfs_message_t msg) {
+        mfs_message_t failed = {.psize = 0, .dsize = 0, .op = RESPONSE_OF(OP_ERROR), .path = 0, .data = 0};
+        if (this->send(msg) != 0) return failed;
+        while (1) {
+            mfs_message_t response = this->receive();
+            if (response.path == 0) return failed;
+            if (response.op == RESPONSE_OF(msg.op) || response.op == RESPONSE_OF(OP_ERROR)) return response;
+        }
+    }
+
+    // Reads the file at path through the cache. path_size is the size of the path buffer, path has to be NULL-terminated within it.
+    // Returns the file's payload, with data pointing into the cache entry (or the response buffer, if the payload isn't cacheable.)
+    // Returns a message with NULL pointers on failure, or the server's OP_ERROR response.
+    mfs_message_t read(char* path, unsigned int path_size) {
+        mfs_message_t failed = {.psize = 0, .dsize = 0, .op = RESPONSE_OF(OP_ERROR), .path = 0, .data = 0};
+        unsigned int len = this->strlen(path, path_size);
+        if (len == 0) return failed;
+
+        mfs_message_t result;
+        result.op = RESPONSE_OF(OP_READ);
+        result.path = path;
+        result.psize = len;
+
+        mfs_cache_entry_t* entry = this->find_entry(path, len);
+        if (entry != 0 && this->push_invalidation) {
+            // Nobody told us it changed, so it didn't.
+            result.data = entry->data;
+            result.dsize = entry->length;
+            return result;
+        }
+
+        char prefix[5];
+        prefix[0] = entry != 0;
+        unsigned int version = entry != 0 ? entry->version : 0;
+        for (unsigned int i = 0; i < 4; i++) prefix[1 + i] = (version >> (8 * i)) & 0xFF;
+        if (this->send_request(OP_READ_IF, path, len, prefix, 5, 0, 0) != 0) return failed;
+
+        mfs_message_t response;
+        do {
+            response = this->receive();
+            if (response.path == 0) return failed;
+        } while (response.op != RESPONSE_OF(OP_READ_IF) && response.op != RESPONSE_OF(OP_ERROR));
+        if (response.op == RESPONSE_OF(OP_ERROR)) return response;
+        if (response.dsize < 5) return failed;
+
+        if (response.data[0] == 0 && entry != 0) {
+            // Not modified.
+            result.data = entry->data;
+            result.dsize = entry->length;
+            return result;
+        }
+
+        result.data = response.data + 5;
+        result.dsize = response.dsize - 5;
+        if (entry == 0) entry = this->claim_entry(path, len);
+        if (entry == 0) return result;
+        if (result.dsize > entry->data_size) {
+            // Doesn't fit, don't keep a stale copy around either.
+            entry->valid = 0;
+            return result;
+        }
+        for (unsigned int i = 0; i < result.dsize; i++) entry->data[i] = result.data[i];
+        entry->length = result.dsize;
+        entry->version = this->get_uint(response.data + 1, 4);
+        entry->valid = 1;
+        result.data = entry->data;
+        return result;
+    }
+
+    // Drops the cached copy of path, the next read fetches it from the server.
+    void invalidate(char* path, unsigned int path_size) {
+        mfs_cache_entry_t* entry = this->find_entry(path, this->strlen(path, path_size));
+        if (entry != 0) entry->valid = 0;
+    }
+
+    void invalidate_all() {
+        for (unsigned int i = 0; i < this->cache_len; i++) this->cache[i].valid = 0;
+    }
+
+    // connection is the server's client_t for the read and write callbacks. The cache buffer is optional.
+    mfs_client(read_cb readerf, write_cb writerf, client_t conn, char* buf, unsigned int buf_size, mfs_cache_entry_t* cbuf = 0, unsigned int cbuf_size = 0) {
+        this->server_reader = readerf;
+        this->server_writer = writerf;
+        this->connection = conn;
+        this->buffer = buf;
+        this->bsize = buf_size;
+        this->cache = cbuf;
+        this->cache_len = cbuf_size;
+    }
+};
+
+// A pooled connection. All fields should be zero initially.
+typedef struct {
+    client_t connection; // 0 if not connected.
+    unsigned int in_flight; // Requests sent on it that haven't been answered yet.
+} mfs_connection_t;
+
+// A request waiting for its response. All fields should be zero initially.
+typedef struct {
+    unsigned char used;
+    unsigned char op;
+    unsigned int connection; // Index into the connection table.
+    unsigned long long sequence; // Submission order, responses come back in this order per connection.
+    mfs_response_cb done;
+    void* context;
+} mfs_pending_t;
+
+// A pool of connections to one server, with pipelining.
+// submit() writes the request right away on the least busy connection and returns, responses are matched up in poll() and handed to the request's callback.
+// The server answers every client in order, so each connection is simply a FIFO of pending requests.
+// Connections are opened on demand and kept, so consumers stop churning the server's client slots. A broken connection fails its pending requests and is reopened on the next submit().
+// Streams (chunked reads) and pushed updates don't fit the request/response model, stray OP_CHUNK frames and updates are skipped (receive() still applies the updates to the cache.)
+// OP_CREDIT has no response and is sent untracked.
+// OP_READ_MANY answers with a frame per file, it can't be pooled. Use mfs_client::read_many() on a connection of its own.
+class mfs_client_pool {
+    mfs_client codec; // Does the framing, pointed at whichever connection we're working on.
+    connect_cb connector;
+    close_cb closer;
+    available_cb available;
+
+    mfs_connection_t* connections;
+    unsigned int connections_len;
+    mfs_pending_t* pending;
+    unsigned int pending_len;
+    unsigned long long next_sequence = 0;
+
+    // Oldest pending request on connection index, NULL if there is none.
+    mfs_pending_t* oldest(unsigned int index) {
+        mfs_pending_t* result = 0;
+        for (unsigned int i = 0; i < this->pending_len; i++) {
+            mfs_pending_t* p = &this->pending[i];
+            if (!p->used || p->connection != index) continue;
+            if (result == 0 || p->sequence < result->sequence) result = p;
+        }
+        return result;
+    }
+
+    // Closes connection index and fails everything that was waiting on it.
+    void fail_connection(unsigned int index) {
+        mfs_message_t failed = {.psize = 0, .dsize = 0, .op = RESPONSE_OF(OP_ERROR), .path = 0, .data = 0};
+        if (this->connections[index].connection != 0) this->closer(this->connections[index].connection);
+        this->connections[index].connection = 0;
+        this->connections[index].in_flight = 0;
+        for (unsigned int i = 0; i < this->pending_len; i++) {
+            mfs_pending_t* p = &this->pending[i];
+            if (!p->used || p->connection != index) continue;
+            p->used = 0;
+            if (p->done != 0) p->done(p->context, failed);
+        }
+    }
+
+    // Picks the connection for the next request. Prefers an open connection with the fewest requests in flight, opens a new one if they are all busy.
+    // Returns the index, or -1 if everything is at max_in_flight and no new connection can be opened.
+    long long pick_connection() {
+        long long best = -1;
+        for (unsigned int i = 0; i < this->connections_len; i++) {
+            mfs_connection_t* c = &this->connections[i];
+            if (c->connection == 0 || c->in_flight >= this->max_in_flight) continue;
+            if (best == -1 || c->in_flight < this->connections[best].in_flight) best = i;
+        }
+        if (best != -1 && this->connections[best].in_flight == 0) return best; // Idle connection, can't do better.
+
+        for (unsigned int i = 0; i < this->connections_len; i++) {
+            if (this->connections[i].connection != 0) continue;
+            client_t conn = this->connector();
+            if (conn == 0) break; // Server unreachable (or full), make do with what we have.
+            this->connections[i].connection = conn;
+            this->connections[i].in_flight = 0;
+            return i;
+        }
+        return best;
+    }
+
+public:
+    unsigned int max_in_flight = 4; // Pipeline depth per connection.
+
+    // Sends request on a pooled connection, done(context, response) gets called from poll() once the response arrives.
+    // Returns 0 on success, -1 if there is no capacity (all pending slots or all connections busy), the request can't be pooled (OP_READ_MANY, see mfs_client::supports()) or sending failed.
+    int submit(mfs_message_t request, mfs_response_cb done, void* context) {
+        mfs_pending_t* slot = 0;
+        for (unsigned int i = 0; i < this->pending_len && slot == 0; i++) {
+            if (!this->pending[i].used) slot = &this->pending[i];
+        }
+        if (slot == 0 && request.op != OP_CREDIT) return -1;
+        if (request.op == OP_READ_MANY) return -1; // See the class comment, its frames would complete the requests behind it.
+        if (!this->codec.supports(request)) return -1; // Refused before a connection is picked, a refused send isn't a broken connection.
+
+        long long index = this->pick_connection();
+        if (index == -1) return -1;
+        this->codec.set_connection(this->connections[index].connection);
+        if (this->codec.send(request) != 0) {
+            this->fail_connection(index);
+            return -1;
+        }
+        if (request.op == OP_CREDIT) return 0; // No response coming.
+
+        slot->used = 1;
+        slot->op = request.op;
+        slot->connection = index;
+        slot->sequence = this->next_sequence++;
+        slot->done = done;
+        slot->context = context;
+        this->connections[index].in_flight++;
+        return 0;
+    }
+
+    // Reads whatever responses are available and completes their requests. Never waits for a response that hasn't started arriving.
+    // Returns how many requests completed.
+    unsigned int poll() {
+        unsigned int completed = 0;
+        for (unsigned int i = 0; i < this->connections_len; i++) {
+            mfs_connection_t* c = &this->connections[i];
+            while (c->connection != 0 && c->in_flight != 0 && this->available(c->connection) >= 9) {
+                this->codec.set_connection(c->connection);
+                mfs_message_t response = this->codec.receive();
+                if (response.path == 0) {
+                    // Broken (or oversized) response, we can't tell which request it belonged to anymore.
+                    this->fail_connection(i);
+                    break;
+                }
+                mfs_pending_t* p = this->oldest(i);
+                if (p == 0) break;
+                if (response.op == RESPONSE_OF(OP_CHUNK) && p->op != OP_CHUNK) continue; // Stream data, not ours.
+                if (response.op == RESPONSE_OF(OP_SUBSCRIBE) && (p->op != OP_SUBSCRIBE || response.dsize != 1)) continue; // A pushed update, only the 1 byte acknowledgement answers OP_SUBSCRIBE.
+
+                p->used = 0;
+                c->in_flight--;
+                completed++;
+                if (p->done != 0) p->done(p->context, response);
+            }
+        }
+        return completed;
+    }
+
+    // Total number of requests waiting for a response.
+    unsigned int in_flight() {
+        unsigned int total = 0;
+        for (unsigned int i = 0; i < this->connections_len; i++) total += this->connections[i].in_flight;
+        return total;
+    }
+
+    // Closes every connection, pending requests fail.
+    void close_all() {
+        for (unsigned int i = 0; i < this->connections_len; i++) this->fail_connection(i);
+    }
+
+    // buf is the response buffer, shared by all connections. cbuf is the connection table (its size is the pool size), pbuf holds the pending requests.
+    mfs_client_pool(read_cb readerf, write_cb writerf, connect_cb connectf, close_cb closef, available_cb availf, char* buf, unsigned int buf_size, mfs_connection_t* cbuf, unsigned int cbuf_size, mfs_pending_t* pbuf, unsigned int pbuf_size)
+        : codec(readerf, writerf, 0, buf, buf_size) {
+        this->connector = connectf;
+        this->closer = closef;
+        this->available = availf;
+        this->connections = cbuf;
+        this->connections_len = cbuf_size;
+        this->pending = pbuf;
+        this->pending_len = pbuf_size;
     }
 };
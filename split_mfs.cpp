@@ -0,0 +1,408 @@
+// Split mode test for mfs_server, built by fuzz.sh split. Linux only: the I/O loop and the handler loop run as two threads pinned to two cores, the way
+// they would run on the two cores of an MCU (see mfs_server::enable_split().) Build it with ThreadSanitizer to catch both loops touching the same state.
+// A few scripted clients talk to the server over an in-memory transport, only ever touched by the I/O thread. Every response is checked against its request, and:
+//   - every handler has to run on the handler thread,
+//   - the ops split mode refuses have to come back as error 3003,
+//   - files are updated, unregistered and registered again by the I/O thread while requests to them are in flight.
+// Usage: split_mfs [requests per client]. Exits with 1 (and says why) on the first failure.
+#define MFS_ASSERT(x) if (!(x)) __builtin_trap()
+#include "main.cpp"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#define SPLIT_CLIENTS 3
+#define SPLIT_JOBS 4
+#define SPLIT_DATA_BSIZE 64
+#define SPLIT_PIPE 256
+
+// One end of a client connection. in is what the client sent and the server hasn't read yet, out is what the server wrote and the client hasn't read yet.
+typedef struct {
+    char in[SPLIT_PIPE];
+    unsigned int in_len;
+    char out[SPLIT_PIPE];
+    unsigned int out_len;
+    unsigned int sent; // Requests sent so far.
+    unsigned int expect; // What the outstanding request should get back, see check_response(). 0 if there is none.
+    char echo[16]; // Request data of an outstanding /echo read.
+} split_pipe_t;
+
+static split_pipe_t pipes[SPLIT_CLIENTS + 1];
+static client_t pending_accept = 0;
+static pthread_t handler_thread;
+static int stop = 0; // Set by the I/O thread when it's done, read by the handler thread. Atomics only.
+static unsigned int wrong_thread = 0; // Handler calls outside of the handler thread. Atomics only.
+
+static char path_buffer[32];
+static char data_buffer[SPLIT_DATA_BSIZE];
+static client_handlers_t clients[SPLIT_CLIENTS];
+static mfs_file_t files[8];
+static mfs_job_t jobs[SPLIT_JOBS];
+static char job_buffers[SPLIT_JOBS][2 * (32 + SPLIT_DATA_BSIZE)];
+static unsigned int queue_slots[2 * SPLIT_JOBS];
+
+static void fail(const char* why, client_t client) {
+    printf("FAILED: %s (client %u, request %u)\n", why, client, pipes[client].sent);
+    fflush(stdout);
+    _exit(1); // The handler thread is still running, don't tear anything down under it.
+}
+
+// Transport callbacks, I/O thread only.
+static long long split_read(client_t client, char* buffer, unsigned long long size) {
+    split_pipe_t* p = &pipes[client];
+    unsigned int n = size < p->in_len ? size : p->in_len;
+    memcpy(buffer, p->in, n);
+    memmove(p->in, p->in + n, p->in_len - n);
+    p->in_len -= n;
+    return n;
+}
+
+static long long split_write(client_t client, char* buffer, unsigned long long size) {
+    split_pipe_t* p = &pipes[client];
+    if (size > sizeof p->out - p->out_len) fail("client pipe overflow", client);
+    if (size == 0) return 0; // Empty paths and payloads may come with a NULL buffer.
+    memcpy(p->out + p->out_len, buffer, size);
+    p->out_len += size;
+    return size;
+}
+
+static void split_close(client_t client) {
+    fail("client closed", client);
+}
+
+static unsigned long long split_available(client_t client) {
+    return client != 0 ? pipes[client].in_len : 0;
+}
+
+static client_t split_accept() {
+    client_t client = pending_accept;
+    pending_accept = 0;
+    return client;
+}
+
+// A real clock. The handler thread may not get to run for a while (on a single core machine, say), that must not look like idle clients.
+static unsigned long long split_time() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// File handlers. The state they share is only ever touched on the handler thread, ThreadSanitizer would notice otherwise.
+static char value[16] = "0";
+static unsigned int value_len = 1;
+static char echoed[24];
+static char doubled[24];
+
+static void on_handler_thread() {
+    if (!pthread_equal(pthread_self(), handler_thread)) __atomic_fetch_add(&wrong_thread, 1, __ATOMIC_RELAXED);
+}
+
+static mfs_message_t read_echo(mfs_message_t request) {
+    on_handler_thread();
+    echoed[0] = 'r';
+    unsigned int n = request.dsize < sizeof echoed - 1 ? request.dsize : sizeof echoed - 1;
+    memcpy(echoed + 1, request.data, n);
+    request.op = RESPONSE_OF(OP_READ);
+    request.data = echoed;
+    request.dsize = n + 1;
+    return request;
+}
+
+static mfs_message_t read_value(mfs_message_t request) {
+    on_handler_thread();
+    request.op = RESPONSE_OF(OP_READ);
+    request.data = value;
+    request.dsize = value_len;
+    return request;
+}
+
+// Takes digits only, anything else is refused.
+static mfs_message_t write_value(mfs_message_t request) {
+    static char refused[2] = {1, 0};
+    on_handler_thread();
+    for (unsigned int i = 0; i < request.dsize; i++) {
+        if (request.data[i] < '0' || request.data[i] > '9') {
+            request.op = RESPONSE_OF(OP_ERROR);
+            request.data = refused;
+            request.dsize = 2;
+            return request;
+        }
+    }
+    value_len = request.dsize < sizeof value ? request.dsize : sizeof value;
+    memcpy(value, request.data, value_len);
+    request.op = RESPONSE_OF(OP_WRITE);
+    request.dsize = 0;
+    return request;
+}
+
+static mfs_message_t read_doubled(void* /*context*/, unsigned int /*file_index*/, client_t /*client*/, mfs_message_t request) {
+    on_handler_thread();
+    doubled[0] = 'd';
+    memcpy(doubled + 1, value, value_len);
+    memcpy(doubled + 1 + value_len, value, value_len);
+    request.op = RESPONSE_OF(OP_READ);
+    request.data = doubled;
+    request.dsize = 1 + 2 * value_len;
+    return request;
+}
+
+static long long read_stream(unsigned long long /*offset*/, char* /*buffer*/, unsigned int /*size*/) {
+    on_handler_thread();
+    return 0;
+}
+
+static char echo_path[] = "/echo";
+static char value_path[] = "/value";
+static char doubled_path[] = "/doubled";
+static char stream_path[] = "/stream";
+static char doubled_deps[] = "/value";
+static char doubled_cache[24];
+static mfs_derived_t doubled_derived;
+static mfs_file_t echo_file;
+
+static void setup_files(mfs_server* server) {
+    echo_file.path = echo_path;
+    echo_file.path_size = sizeof echo_path;
+    echo_file.reader_f = read_echo;
+    server->register_file(&echo_file);
+
+    mfs_file_t file = {};
+    file.path = value_path;
+    file.path_size = sizeof value_path;
+    file.reader_f = read_value;
+    file.writer_f = write_value;
+    server->register_file(&file);
+
+    doubled_derived.deps = doubled_deps;
+    doubled_derived.deps_size = sizeof doubled_deps;
+    doubled_derived.cache = doubled_cache;
+    doubled_derived.cache_size = sizeof doubled_cache;
+    file = {};
+    file.path = doubled_path;
+    file.path_size = sizeof doubled_path;
+    file.reader_ctx_f = read_doubled;
+    file.derived = &doubled_derived;
+    server->register_file(&file);
+
+    file = {};
+    file.path = stream_path;
+    file.path_size = sizeof stream_path;
+    file.chunk_reader_f = read_stream;
+    server->register_file(&file);
+}
+
+// What an outstanding request should get back.
+enum {
+    EXPECT_ECHO = 1, // "r" followed by the request data, or error 1000 if /echo was unregistered meanwhile.
+    EXPECT_READ, // RESPONSE_OF(OP_READ) with digits after prefix_len bytes.
+    EXPECT_WRITE, // RESPONSE_OF(OP_WRITE).
+    EXPECT_REFUSED_WRITE, // The writer's own error 1.
+    EXPECT_READ_IF, // RESPONSE_OF(OP_READ_IF), modified with digits.
+    EXPECT_3003, // Refused by split mode.
+};
+
+static void send_request(client_t client, unsigned char op, const char* path, const char* data, unsigned int dsize, unsigned int expect) {
+    split_pipe_t* p = &pipes[client];
+    unsigned int psize = strlen(path) + 1;
+    char* at = p->in + p->in_len;
+    for (unsigned int i = 0; i < 4; i++) {
+        at[i] = (psize >> (8 * i)) & 0xFF;
+        at[4 + i] = (dsize >> (8 * i)) & 0xFF;
+    }
+    at[8] = op;
+    memcpy(at + 9, path, psize);
+    memcpy(at + 9 + psize, data, dsize);
+    p->in_len += 9 + psize + dsize;
+    p->expect = expect;
+    p->sent++;
+}
+
+// Sends client's next request. Every kind of request comes up, in an order that differs between clients. Ops stripped by the feature configuration
+// (FUZZ_FLAGS) are replaced with reads of /echo.
+static void next_request(client_t client) {
+    split_pipe_t* p = &pipes[client];
+    char data[16];
+    switch ((p->sent + client) % 9) {
+#if MFS_ENABLE_WRITE
+    case 2:
+        snprintf(data, sizeof data, "%u", p->sent);
+        send_request(client, OP_WRITE, "/value", data, strlen(data), EXPECT_WRITE);
+        return;
+    case 3:
+        send_request(client, OP_WRITE, "/value", "nope", 4, EXPECT_REFUSED_WRITE);
+        return;
+#endif
+    case 4:
+        send_request(client, OP_READ, "/value", "", 0, EXPECT_READ);
+        return;
+    case 5:
+        send_request(client, OP_READ, "/doubled", "", 0, EXPECT_READ);
+        return;
+#if MFS_ENABLE_READ_IF
+    case 6:
+        // Without a cached copy, so always modified. /doubled comes from its cache or its reader, depending on whether /value moved meanwhile.
+        memset(data, 0, 5);
+        send_request(client, OP_READ_IF, p->sent % 2 ? "/value" : "/doubled", data, 5, EXPECT_READ_IF);
+        return;
+#endif
+#if MFS_ENABLE_SUBSCRIBE
+    case 7:
+        send_request(client, OP_SUBSCRIBE, "/value", "\x01", 1, EXPECT_3003);
+        return;
+#endif
+    case 8:
+#if MFS_ENABLE_READ_MANY
+        if (p->sent % 2) {
+            send_request(client, OP_READ_MANY, "/", "", 0, EXPECT_3003);
+            return;
+        }
+#endif
+#if MFS_ENABLE_STREAMING
+        send_request(client, OP_READ, "/stream", "", 0, EXPECT_3003);
+        return;
+#endif
+        break;
+    }
+    snprintf(p->echo, sizeof p->echo, "%u-%u", client, p->sent);
+    send_request(client, OP_READ, "/echo", p->echo, strlen(p->echo), EXPECT_ECHO);
+}
+
+static int digits(const char* data, unsigned int size) {
+    if (size == 0) return 0;
+    for (unsigned int i = 0; i < size; i++) {
+        if (data[i] < '0' || data[i] > '9') return 0;
+    }
+    return 1;
+}
+
+// Checks the response to client's outstanding request, if it's complete. Returns 1 once it has been checked.
+static int check_response(client_t client) {
+    split_pipe_t* p = &pipes[client];
+    if (p->out_len < 9) return 0;
+    unsigned int psize = 0, dsize = 0;
+    for (unsigned int i = 0; i < 4; i++) {
+        psize |= (unsigned int)(unsigned char)p->out[i] << (8 * i);
+        dsize |= (unsigned int)(unsigned char)p->out[4 + i] << (8 * i);
+    }
+    if (9 + psize + dsize > sizeof p->out) fail("malformed response", client);
+    if (p->out_len < 9 + psize + dsize) return 0;
+    unsigned char op = p->out[8];
+    char* data = p->out + 9 + psize;
+    unsigned int error = dsize == 2 ? (unsigned char)data[0] | ((unsigned char)data[1] << 8) : 0;
+    int is_error = op == RESPONSE_OF(OP_ERROR);
+
+    switch (p->expect) {
+    case EXPECT_ECHO:
+        if (is_error && error == 1000) break;
+        if (op != RESPONSE_OF(OP_READ) || dsize != 1 + strlen(p->echo) || data[0] != 'r' || memcmp(data + 1, p->echo, dsize - 1) != 0) fail("wrong /echo response", client);
+        break;
+    case EXPECT_READ:
+        if (op != RESPONSE_OF(OP_READ) || !digits(data + (data[0] == 'd'), dsize - (data[0] == 'd'))) fail("wrong read response", client);
+        break;
+    case EXPECT_WRITE:
+        if (op != RESPONSE_OF(OP_WRITE)) fail("write not taken", client);
+        break;
+    case EXPECT_REFUSED_WRITE:
+        if (!is_error || error != 1) fail("refused write not passed on", client);
+        break;
+    case EXPECT_READ_IF:
+        if (op != RESPONSE_OF(OP_READ_IF) || dsize < 6 || data[0] != 1 || !digits(data + 5 + (data[5] == 'd'), dsize - 5 - (data[5] == 'd'))) fail("wrong OP_READ_IF response", client);
+        break;
+    case EXPECT_3003:
+        if (!is_error || error != 3003) fail("op not refused in split mode", client);
+        break;
+    }
+    unsigned int used = 9 + psize + dsize;
+    memmove(p->out, p->out + used, p->out_len - used);
+    p->out_len -= used;
+    p->expect = 0;
+    return 1;
+}
+
+static void pin_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof set, &set); // Best effort, a single core machine still runs the test.
+}
+
+static void* handler_loop(void* arg) {
+    mfs_server* server = (mfs_server*)arg;
+    pin_to_cpu(1);
+    while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+        if (server->serve_handlers() == 0) sched_yield(); // Lets the I/O thread run on a single core machine.
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    unsigned int requests = argc > 1 ? atoi(argv[1]) : 20000;
+    static mfs_server server(split_read, split_write, split_accept, split_close, split_time, split_available, data_buffer, sizeof data_buffer, path_buffer,
+                             sizeof path_buffer, clients, SPLIT_CLIENTS, files, 8);
+    setup_files(&server);
+    for (unsigned int i = 0; i < SPLIT_JOBS; i++) {
+        jobs[i].buffer = job_buffers[i];
+        jobs[i].bsize = sizeof job_buffers[i];
+    }
+    server.enable_split(jobs, SPLIT_JOBS, queue_slots);
+    for (client_t client = 1; client <= SPLIT_CLIENTS; client++) {
+        pending_accept = client;
+        server.accept_clients();
+    }
+
+    pin_to_cpu(0);
+    handler_thread = pthread_self(); // Not the handler thread yet, nothing runs handlers before it starts.
+    if (pthread_create(&handler_thread, 0, handler_loop, &server) != 0) {
+        printf("FAILED: no handler thread\n");
+        return 1;
+    }
+
+    unsigned int done = 0, refused_unregisters = 0, passes = 0;
+    unsigned long long last_response = split_time();
+    int echo_registered = 1;
+    while (done < SPLIT_CLIENTS) {
+        server.serve_io();
+        passes++;
+        // The application keeps changing files while their requests are in flight.
+        if (passes % 7 == 0) server.update_file(value_path, sizeof value_path, 0);
+        if (passes % 13 == 0) {
+            if (echo_registered) {
+                if (server.unregister_file(echo_path, sizeof echo_path) == 0) echo_registered = 0;
+                else refused_unregisters++;
+            } else if (server.register_file(&echo_file) == 0) {
+                echo_registered = 1;
+            }
+        }
+        done = 0;
+        unsigned int answered = 0;
+        for (client_t client = 1; client <= SPLIT_CLIENTS; client++) {
+            split_pipe_t* p = &pipes[client];
+            if (p->expect != 0) {
+                if (!check_response(client)) continue;
+                last_response = split_time();
+                answered++;
+            }
+            if (p->sent < requests) next_request(client);
+            else done++;
+        }
+        if (split_time() - last_response > 5000) {
+            printf("FAILED: no response for 5 seconds after %u passes\n", passes);
+            fflush(stdout);
+            _exit(1);
+        }
+        if (answered == 0) sched_yield();
+    }
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    pthread_join(handler_thread, 0);
+
+    if (__atomic_load_n(&wrong_thread, __ATOMIC_RELAXED) != 0) {
+        printf("FAILED: %u handler calls on the I/O thread\n", wrong_thread);
+        return 1;
+    }
+    printf("%u requests per client in %u passes, %u unregisters refused while in flight.\n", requests, passes, refused_unregisters);
+    return 0;
+}